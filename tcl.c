@@ -1,16 +1,33 @@
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L /* clock_gettime(), flockfile() */
+#endif
+
 #include <stdlib.h>
 
 #include <stdio.h>
 #include <string.h>
 
+#ifndef TCL_DISABLE_SOURCE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef TCL_ENABLE_POOL
+#include <pthread.h>
+#endif
+
+#ifdef TCL_ENABLE_PROFILE
+#include <time.h>
+#endif
+
 #if 0
 #define DBG printf
 #else
 #define DBG(...)
 #endif
 
-#define MAX_VAR_LENGTH 256
-
 struct tcl;
 int tcl_eval(struct tcl *tcl, const char *s, size_t len);
 
@@ -18,16 +35,118 @@ int tcl_eval(struct tcl *tcl, const char *s, size_t len);
 enum { TCMD, TWORD, TPART, TERROR };
 enum { FERROR, FNORMAL, FRETURN, FBREAK, FAGAIN };
 
+/* Character classes are looked up in a table */
+#define TCL_SPACE 1
+#define TCL_END 2
+#define TCL_SPECIAL 4   /* Special outside of quotes */
+#define TCL_SPECIAL_Q 8 /* Special inside of quotes */
+
+static const unsigned char tcl_class[256] = {
+    ['\0'] = TCL_END | TCL_SPECIAL | TCL_SPECIAL_Q,
+    ['\t'] = TCL_SPACE,
+    ['\n'] = TCL_END | TCL_SPECIAL,
+    ['\r'] = TCL_END | TCL_SPECIAL,
+    [' '] = TCL_SPACE,
+    ['"'] = TCL_SPECIAL | TCL_SPECIAL_Q,
+    ['$'] = TCL_SPECIAL | TCL_SPECIAL_Q,
+    [';'] = TCL_END | TCL_SPECIAL,
+    ['['] = TCL_SPECIAL | TCL_SPECIAL_Q,
+    [']'] = TCL_SPECIAL | TCL_SPECIAL_Q,
+    ['{'] = TCL_SPECIAL,
+    ['}'] = TCL_SPECIAL,
+};
+
 static int tcl_is_special(char c, int q) {
-  return (c == '$' || (!q && (c == '{' || c == '}' || c == ';' || c == '\r' ||
-                              c == '\n')) ||
-          c == '[' || c == ']' || c == '"' || c == '\0');
+  return tcl_class[(unsigned char)c] & (q ? TCL_SPECIAL_Q : TCL_SPECIAL);
 }
 
-static int tcl_is_space(char c) { return (c == ' ' || c == '\t'); }
+static int tcl_is_space(char c) {
+  return tcl_class[(unsigned char)c] & TCL_SPACE;
+}
+
+static int tcl_is_end(char c) { return tcl_class[(unsigned char)c] & TCL_END; }
+
+/* Long words and grouped bodies are scanned 16 (SSE2) or 32 (AVX2) bytes at a
+ * time when the compiler targets these instruction sets. Vector loads never
+ * go past the given length, the rest is scanned one byte at a time */
+#if defined(__AVX2__) && !defined(TCL_DISABLE_SIMD)
+#include <immintrin.h>
+#define TCL_SIMD 32
+typedef __m256i tcl_vec_t;
+#define tcl_vec_load(p) _mm256_loadu_si256((const __m256i *)(p))
+#define tcl_vec_set(c) _mm256_set1_epi8(c)
+#define tcl_vec_eq(a, b) _mm256_cmpeq_epi8((a), (b))
+#define tcl_vec_or(a, b) _mm256_or_si256((a), (b))
+#define tcl_vec_and(a, b) _mm256_and_si256((a), (b))
+#define tcl_vec_min(a, b) _mm256_min_epu8((a), (b))
+#define tcl_vec_mask(a) ((unsigned int)_mm256_movemask_epi8(a))
+#elif defined(__SSE2__) && !defined(TCL_DISABLE_SIMD)
+#include <emmintrin.h>
+#define TCL_SIMD 16
+typedef __m128i tcl_vec_t;
+#define tcl_vec_load(p) _mm_loadu_si128((const __m128i *)(p))
+#define tcl_vec_set(c) _mm_set1_epi8(c)
+#define tcl_vec_eq(a, b) _mm_cmpeq_epi8((a), (b))
+#define tcl_vec_or(a, b) _mm_or_si128((a), (b))
+#define tcl_vec_and(a, b) _mm_and_si128((a), (b))
+#define tcl_vec_min(a, b) _mm_min_epu8((a), (b))
+#define tcl_vec_mask(a) ((unsigned int)_mm_movemask_epi8(a))
+#endif
+
+/* Returns the index of the first char of the given classes, or n */
+static size_t tcl_scan_class(const char *s, size_t n, int mask) {
+  size_t i = 0;
+#ifdef TCL_SIMD
+  /* Most words are short, vectors only pay off after the first few bytes */
+  for (; i < n && i < TCL_SIMD; i++) {
+    if (tcl_class[(unsigned char)s[i]] & mask) {
+      return i;
+    }
+  }
+  /* Candidates are chars up to 0x20 (spaces, line ends, NUL), '$', '"', ';'
+   * and chars that look like braces or brackets in the bits that matter, false
+   * positives are filtered out through the table */
+  for (; i + TCL_SIMD <= n; i += TCL_SIMD) {
+    tcl_vec_t v = tcl_vec_load(s + i);
+    tcl_vec_t c = tcl_vec_eq(tcl_vec_min(v, tcl_vec_set(0x20)), v);
+    c = tcl_vec_or(c, tcl_vec_eq(v, tcl_vec_set('$')));
+    c = tcl_vec_or(c, tcl_vec_eq(v, tcl_vec_set('"')));
+    c = tcl_vec_or(c, tcl_vec_eq(v, tcl_vec_set(';')));
+    c = tcl_vec_or(c, tcl_vec_eq(tcl_vec_and(v, tcl_vec_set((char)0xd9)),
+                                 tcl_vec_set(0x59)));
+    for (unsigned int m = tcl_vec_mask(c); m != 0; m = m & (m - 1)) {
+      size_t j = i + __builtin_ctz(m);
+      if (tcl_class[(unsigned char)s[j]] & mask) {
+        return j;
+      }
+    }
+  }
+#endif
+  while (i < n && !(tcl_class[(unsigned char)s[i]] & mask)) {
+    i++;
+  }
+  return i;
+}
 
-static int tcl_is_end(char c) {
-  return (c == '\n' || c == '\r' || c == ';' || c == '\0');
+/* Returns the index of the first char equal to a or b, or n */
+static size_t tcl_scan_pair(const char *s, size_t n, char a, char b) {
+  size_t i = 0;
+#ifdef TCL_SIMD
+  tcl_vec_t va = tcl_vec_set(a);
+  tcl_vec_t vb = tcl_vec_set(b);
+  for (; i + TCL_SIMD <= n; i += TCL_SIMD) {
+    tcl_vec_t v = tcl_vec_load(s + i);
+    unsigned int m =
+        tcl_vec_mask(tcl_vec_or(tcl_vec_eq(v, va), tcl_vec_eq(v, vb)));
+    if (m != 0) {
+      return i + __builtin_ctz(m);
+    }
+  }
+#endif
+  while (i < n && s[i] != a && s[i] != b) {
+    i++;
+  }
+  return i;
 }
 
 int tcl_next(const char *s, size_t n, const char **from, const char **to,
@@ -49,7 +168,7 @@ int tcl_next(const char *s, size_t n, const char **from, const char **to,
     return TCMD;
   }
   if (*s == '$') { /* Variable token, must not start with a space or quote */
-    if (tcl_is_space(s[1]) || s[1] == '"') {
+    if (n < 2 || tcl_is_space(s[1]) || s[1] == '"') {
       return TERROR;
     }
     int mode = *q;
@@ -63,12 +182,12 @@ int tcl_next(const char *s, size_t n, const char **from, const char **to,
     /* Interleaving pairs are not welcome, but it simplifies the code */
     open = *s;
     close = (open == '[' ? ']' : '}');
-    for (i = 0, depth = 1; i < n && depth != 0; i++) {
-      if (i > 0 && s[i] == open) {
-        depth++;
-      } else if (s[i] == close) {
-        depth--;
+    for (i = 1, depth = 1; depth != 0; i++) {
+      i += tcl_scan_pair(s + i, n - i, open, close);
+      if (i >= n) {
+        break;
       }
+      depth += (s[i] == open ? 1 : -1);
     }
   } else if (*s == '"') {
     *q = !*q;
@@ -85,9 +204,7 @@ int tcl_next(const char *s, size_t n, const char **from, const char **to,
     /* Unbalanced bracket or brace */
     return TERROR;
   } else {
-    while (i < n && (*q || !tcl_is_space(s[i])) && !tcl_is_special(s[i], *q)) {
-      i++;
-    }
+    i = tcl_scan_class(s, n, (*q ? TCL_SPECIAL_Q : TCL_SPACE | TCL_SPECIAL));
   }
   *to = s + i;
   if (i == n) {
@@ -116,24 +233,349 @@ struct tcl_parser {
         (skiperr));                                                            \
        p.start = p.to)
 
+/* Resumable command splitter for reading scripts from a stream. It keeps the
+ * brace/bracket depth and quoting mode between calls, so the input can be fed
+ * in chunks of any size and every byte is scanned only once. Returns the
+ * length of the chunk prefix that completes a command (including the command
+ * separator), or 0 if the command continues in the next chunk.
+ *
+ * Commands end where tcl_next() ends them: groups are matched the same way,
+ * inside quotes only "${" starts a brace group, and a NUL ends a command just
+ * like a newline. Scripts that tcl_next() rejects may be split differently */
+struct tcl_reader {
+  char open; /* '{' or '[' inside a group, 0 otherwise */
+  int depth;
+  int q;
+  int var; /* The last char was a '$' */
+};
+
+size_t tcl_reader_feed(struct tcl_reader *r, const char *s, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    char c = s[i];
+    int var = r->var;
+    r->var = 0;
+    if (r->open) {
+      if (c == r->open) {
+        r->depth++;
+      } else if (c == (r->open == '[' ? ']' : '}') && --r->depth == 0) {
+        r->open = 0;
+      }
+    } else if (c == '[' || (c == '{' && (!r->q || var))) {
+      r->open = c;
+      r->depth = 1;
+    } else if (c == '$') {
+      r->var = 1;
+    } else if (c == '"') {
+      r->q = !r->q;
+    } else if (!r->q && tcl_is_end(c)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
 /* ------------------------------------------------------- */
-typedef char tcl_value_t;
+/* Memory allocator used by an interpreter for its values and environments.
+ * Blocks are always freed with the size they were allocated with, so an
+ * allocator doesn't need to keep a header for each block */
+struct tcl_allocator {
+  void *(*alloc)(struct tcl_allocator *mem, size_t size);
+  void *(*realloc)(struct tcl_allocator *mem, void *p, size_t old,
+                   size_t size);
+  void (*free)(struct tcl_allocator *mem, void *p, size_t size);
+};
+
+static void *tcl_malloc_alloc(struct tcl_allocator *mem, size_t size) {
+  (void)mem;
+  return malloc(size);
+}
+
+static void *tcl_malloc_realloc(struct tcl_allocator *mem, void *p,
+                                size_t old, size_t size) {
+  (void)mem;
+  (void)old;
+  return realloc(p, size);
+}
+
+static void tcl_malloc_free(struct tcl_allocator *mem, void *p, size_t size) {
+  (void)mem;
+  (void)size;
+  free(p);
+}
+
+struct tcl_allocator tcl_malloc_allocator = {
+    tcl_malloc_alloc, tcl_malloc_realloc, tcl_malloc_free};
+
+/* A pool allocator keeps a free list for each size class. Blocks are carved
+ * from chunks that are returned to malloc only when the pool is destroyed,
+ * larger blocks are passed to malloc directly */
+#define TCL_POOL_CLASSES 5 /* 16, 32, 64, 128 and 256 bytes */
+#define TCL_POOL_CHUNK 4096
+
+struct tcl_pool {
+  struct tcl_allocator mem; /* Must be the first field */
+  void *free[TCL_POOL_CLASSES];
+  void *chunks;
+};
+
+static int tcl_pool_class(size_t size) {
+  int c = 0;
+  for (size_t n = 16; n < size; n = n * 2) {
+    c++;
+  }
+  return c < TCL_POOL_CLASSES ? c : -1;
+}
+
+static void *tcl_pool_alloc(struct tcl_allocator *mem, size_t size) {
+  struct tcl_pool *pool = (struct tcl_pool *)mem;
+  int c = tcl_pool_class(size);
+  if (c < 0) {
+    return malloc(size);
+  }
+  if (pool->free[c] == NULL) {
+    /* The first 16 bytes of a chunk link it to the other chunks */
+    size_t n = (size_t)16 << c;
+    char *chunk = malloc(TCL_POOL_CHUNK);
+    *(void **)chunk = pool->chunks;
+    pool->chunks = chunk;
+    for (char *p = chunk + 16; p + n <= chunk + TCL_POOL_CHUNK; p += n) {
+      *(void **)p = pool->free[c];
+      pool->free[c] = p;
+    }
+  }
+  void *p = pool->free[c];
+  pool->free[c] = *(void **)p;
+  return p;
+}
+
+static void tcl_pool_free(struct tcl_allocator *mem, void *p, size_t size) {
+  struct tcl_pool *pool = (struct tcl_pool *)mem;
+  int c = tcl_pool_class(size);
+  if (c < 0) {
+    free(p);
+  } else if (p != NULL) {
+    *(void **)p = pool->free[c];
+    pool->free[c] = p;
+  }
+}
+
+static void *tcl_pool_realloc(struct tcl_allocator *mem, void *p, size_t old,
+                              size_t size) {
+  int c = tcl_pool_class(old);
+  if (p != NULL && c >= 0 && c == tcl_pool_class(size)) {
+    return p;
+  }
+  if (p != NULL && c < 0 && tcl_pool_class(size) < 0) {
+    return realloc(p, size);
+  }
+  void *q = tcl_pool_alloc(mem, size);
+  if (p != NULL) {
+    memcpy(q, p, old < size ? old : size);
+    tcl_pool_free(mem, p, old);
+  }
+  return q;
+}
+
+void tcl_pool_init(struct tcl_pool *pool) {
+  pool->mem.alloc = tcl_pool_alloc;
+  pool->mem.realloc = tcl_pool_realloc;
+  pool->mem.free = tcl_pool_free;
+  memset(pool->free, 0, sizeof(pool->free));
+  pool->chunks = NULL;
+}
+
+void tcl_pool_destroy(struct tcl_pool *pool) {
+  while (pool->chunks != NULL) {
+    void *chunk = pool->chunks;
+    pool->chunks = *(void **)chunk;
+    free(chunk);
+  }
+  memset(pool->free, 0, sizeof(pool->free));
+}
+
+/* ------------------------------------------------------- */
+/* ------------------------------------------------------- */
+/* Values are reference counted strings that know their length. tcl_dup()
+ * only adds a reference, a shared value is copied before it is modified.
+ * A value may also cache its meaning as an integer, a list or a dict. Numbers
+ * produced by arithmetic and lists built with tcl_list_append() get their
+ * string representation only when somebody asks for it. Each value remembers
+ * the allocator it came from, values made by tcl_alloc() and friends use
+ * malloc, values made by the interpreter use the interpreter allocator */
+#define TCL_VALUE_INT 1
+#define TCL_VALUE_LIST 2
+#define TCL_VALUE_DICT 4
+
+typedef struct tcl_value {
+  char *data; /* NULL if the value has no string representation yet */
+  int len;
+  int cap;
+  int refs;
+  int flags;
+  int num;
+  struct tcl_value **items;
+  int nitems;
+  int itemcap;
+  int *index; /* Dicts only: capacity, number of keys, then the hash slots */
+  struct tcl_allocator *mem;
+} tcl_value_t;
+
+static void tcl_list_string(tcl_value_t *v);
+
+const char *tcl_string(tcl_value_t *v) {
+  if (v == NULL) {
+    return "";
+  }
+  if (v->data == NULL && (v->flags & TCL_VALUE_LIST)) {
+    tcl_list_string(v);
+  } else if (v->data == NULL) {
+    char buf[16];
+    char *p = buf + sizeof(buf);
+    unsigned int n = (unsigned int)v->num;
+    if (v->num < 0) {
+      n = 0u - n;
+    }
+    do {
+      *--p = '0' + (n % 10);
+      n = n / 10;
+    } while (n > 0);
+    if (v->num < 0) {
+      *--p = '-';
+    }
+    v->len = buf + sizeof(buf) - p;
+    v->cap = v->len + 1;
+    v->data = v->mem->alloc(v->mem, v->cap);
+    memcpy(v->data, p, v->len);
+    v->data[v->len] = '\0';
+  }
+  return v->data;
+}
+
+int tcl_int(tcl_value_t *v) {
+  if (v == NULL) {
+    return 0;
+  }
+  if (!(v->flags & TCL_VALUE_INT)) {
+    v->num = atoi(tcl_string(v));
+    v->flags |= TCL_VALUE_INT;
+  }
+  return v->num;
+}
+
+int tcl_length(tcl_value_t *v) {
+  if (v == NULL) {
+    return 0;
+  }
+  tcl_string(v);
+  return v->len;
+}
+
+void tcl_free(tcl_value_t *);
+
+static void tcl_dict_drop(tcl_value_t *v) {
+  if (v->flags & TCL_VALUE_DICT) {
+    v->mem->free(v->mem, v->index, (v->index[0] + 2) * sizeof(int));
+    v->index = NULL;
+    v->flags &= ~TCL_VALUE_DICT;
+  }
+}
+
+static void tcl_list_drop(tcl_value_t *v) {
+  tcl_dict_drop(v);
+  if (v->flags & TCL_VALUE_LIST) {
+    for (int i = 0; i < v->nitems; i++) {
+      tcl_free(v->items[i]);
+    }
+    v->mem->free(v->mem, v->items, v->itemcap * sizeof(tcl_value_t *));
+    v->items = NULL;
+    v->nitems = v->itemcap = 0;
+    v->flags &= ~TCL_VALUE_LIST;
+  }
+}
+
+static void tcl_string_drop(tcl_value_t *v) {
+  v->mem->free(v->mem, v->data, v->cap);
+  v->data = NULL;
+  v->len = v->cap = 0;
+}
+
+void tcl_free(tcl_value_t *v) {
+  if (v != NULL && --v->refs == 0) {
+    tcl_list_drop(v);
+    tcl_string_drop(v);
+    v->mem->free(v->mem, v, sizeof(tcl_value_t));
+  }
+}
+
+static tcl_value_t *tcl_value_alloc(struct tcl_allocator *mem, int flags) {
+  tcl_value_t *v = mem->alloc(mem, sizeof(tcl_value_t));
+  v->data = NULL;
+  v->len = v->cap = 0;
+  v->refs = 1;
+  v->flags = flags;
+  v->num = 0;
+  v->items = NULL;
+  v->nitems = v->itemcap = 0;
+  v->index = NULL;
+  v->mem = mem;
+  return v;
+}
+
+static tcl_value_t *tcl_value_new(struct tcl_allocator *mem, const char *s,
+                                  size_t len) {
+  tcl_value_t *v = tcl_value_alloc(mem, 0);
+  v->data = mem->alloc(mem, len + 1);
+  if (len > 0) {
+    memcpy(v->data, s, len);
+  }
+  v->data[len] = '\0';
+  v->len = len;
+  v->cap = len + 1;
+  return v;
+}
+
+static tcl_value_t *tcl_value_int(struct tcl_allocator *mem, int n) {
+  tcl_value_t *v = tcl_value_alloc(mem, TCL_VALUE_INT);
+  v->num = n;
+  return v;
+}
 
-const char *tcl_string(tcl_value_t *v) { return v; }
-int tcl_int(tcl_value_t *v) { return atoi(v); }
-int tcl_length(tcl_value_t *v) { return v == NULL ? 0 : strlen(v); }
+tcl_value_t *tcl_alloc(const char *s, size_t len) {
+  return tcl_value_new(&tcl_malloc_allocator, s, len);
+}
 
-void tcl_free(tcl_value_t *v) { free(v); }
+tcl_value_t *tcl_int_alloc(int n) {
+  return tcl_value_int(&tcl_malloc_allocator, n);
+}
 
+/* Appends in place unless the value is shared. Capacity grows geometrically,
+ * so building a string or a list with many appends takes linear time */
 tcl_value_t *tcl_append_string(tcl_value_t *v, const char *s, size_t len) {
-  size_t n = tcl_length(v);
-  v = realloc(v, n + len + 1);
-  memset((char *)tcl_string(v) + n, 0, len + 1);
-  strncpy((char *)tcl_string(v) + n, s, len);
+  if (v == NULL) {
+    return tcl_alloc(s, len);
+  }
+  if (v->refs > 1) {
+    v->refs--;
+    v = tcl_value_new(v->mem, tcl_string(v), tcl_length(v));
+  }
+  tcl_string(v);
+  tcl_list_drop(v);
+  v->flags &= ~TCL_VALUE_INT;
+  size_t n = v->len + len + 1;
+  if (n > (size_t)v->cap) {
+    size_t cap = (n > 2 * (size_t)v->cap ? n : 2 * (size_t)v->cap);
+    v->data = v->mem->realloc(v->mem, v->data, v->cap, cap);
+    v->cap = cap;
+  }
+  if (len > 0) {
+    memcpy(v->data + v->len, s, len);
+  }
+  v->len += len;
+  v->data[v->len] = '\0';
   return v;
 }
 
@@ -143,66 +585,271 @@ tcl_value_t *tcl_append(tcl_value_t *v, tcl_value_t *tail) {
   return v;
 }
 
-tcl_value_t *tcl_alloc(const char *s, size_t len) {
-  return tcl_append_string(NULL, s, len);
-}
-
 tcl_value_t *tcl_dup(tcl_value_t *v) {
-  return tcl_alloc(tcl_string(v), tcl_length(v));
+  if (v == NULL) {
+    return tcl_alloc("", 0);
+  }
+  v->refs++;
+  return v;
 }
 
-tcl_value_t *tcl_list_alloc() { return tcl_alloc("", 0); }
+/* Lists keep an array of element values. A list parsed from a string keeps
+ * both representations, a modified list drops its string until needed */
+tcl_value_t *tcl_list_alloc() {
+  return tcl_value_alloc(&tcl_malloc_allocator, TCL_VALUE_LIST);
+}
 
-int tcl_list_length(tcl_value_t *v) {
-  int count = 0;
-  tcl_each(tcl_string(v), tcl_length(v) + 1, 0) {
-    if (p.token == TWORD) {
-      count++;
-    }
+static void tcl_list_push(tcl_value_t *v, tcl_value_t *item) {
+  if (v->nitems == v->itemcap) {
+    int cap = (v->itemcap == 0 ? 4 : v->itemcap * 2);
+    v->items = v->mem->realloc(v->mem, v->items,
+                               v->itemcap * sizeof(tcl_value_t *),
+                               cap * sizeof(tcl_value_t *));
+    v->itemcap = cap;
   }
-  return count;
+  v->items[v->nitems++] = item;
 }
 
-void tcl_list_free(tcl_value_t *v) { free(v); }
-
-tcl_value_t *tcl_list_at(tcl_value_t *v, int index) {
-  int i = 0;
+static void tcl_list_parse(tcl_value_t *v) {
+  if (v->flags & TCL_VALUE_LIST) {
+    return;
+  }
   tcl_each(tcl_string(v), tcl_length(v) + 1, 0) {
     if (p.token == TWORD) {
-      if (i == index) {
-        if (p.from[0] == '{') {
-          return tcl_alloc(p.from + 1, p.to - p.from - 2);
-        }
-        return tcl_alloc(p.from, p.to - p.from);
+      if (p.from[0] == '{') {
+        tcl_list_push(v, tcl_value_new(v->mem, p.from + 1, p.to - p.from - 2));
+      } else {
+        tcl_list_push(v, tcl_value_new(v->mem, p.from, p.to - p.from));
       }
-      i++;
     }
   }
-  return NULL;
+  v->flags |= TCL_VALUE_LIST;
 }
 
-tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
-  if (tcl_length(v) > 0) {
-    v = tcl_append(v, tcl_alloc(" ", 2));
-  }
-  if (tcl_length(tail) > 0) {
+static void tcl_list_string(tcl_value_t *v) {
+  tcl_value_t *s = tcl_value_new(v->mem, "", 0);
+  for (int i = 0; i < v->nitems; i++) {
+    tcl_value_t *item = v->items[i];
+    const char *p = tcl_string(item);
     int q = 0;
-    const char *p;
-    for (p = tcl_string(tail); *p; p++) {
-      if (tcl_is_space(*p) || tcl_is_special(*p, 0)) {
+    if (i > 0) {
+      s = tcl_append_string(s, " ", 1);
+    }
+    for (int j = 0; j < tcl_length(item); j++) {
+      if (tcl_is_space(p[j]) || tcl_is_special(p[j], 0)) {
         q = 1;
         break;
       }
     }
-    if (q) {
-      v = tcl_append(v, tcl_alloc("{", 1));
+    if (tcl_length(item) == 0) {
+      s = tcl_append_string(s, "{}", 2);
+    } else if (q) {
+      s = tcl_append_string(s, "{", 1);
+      s = tcl_append_string(s, p, tcl_length(item));
+      s = tcl_append_string(s, "}", 1);
+    } else {
+      s = tcl_append_string(s, p, tcl_length(item));
+    }
+  }
+  v->data = s->data;
+  v->len = s->len;
+  v->cap = s->cap;
+  s->mem->free(s->mem, s, sizeof(tcl_value_t));
+}
+
+int tcl_list_length(tcl_value_t *v) {
+  if (v == NULL) {
+    return 0;
+  }
+  tcl_list_parse(v);
+  return v->nitems;
+}
+
+void tcl_list_free(tcl_value_t *v) { tcl_free(v); }
+
+tcl_value_t *tcl_list_at(tcl_value_t *v, int index) {
+  if (index < 0 || index >= tcl_list_length(v)) {
+    return NULL;
+  }
+  return tcl_dup(v->items[index]);
+}
+
+tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
+  tcl_value_t *item = tcl_dup(tail);
+  if (v == NULL) {
+    v = tcl_list_alloc();
+  }
+  tcl_list_parse(v);
+  if (v->refs > 1) {
+    tcl_value_t *copy = tcl_value_alloc(v->mem, TCL_VALUE_LIST);
+    for (int i = 0; i < v->nitems; i++) {
+      tcl_list_push(copy, tcl_dup(v->items[i]));
+    }
+    tcl_free(v);
+    v = copy;
+  }
+  tcl_dict_drop(v);
+  tcl_list_push(v, item);
+  tcl_string_drop(v);
+  v->flags &= ~TCL_VALUE_INT;
+  return v;
+}
+
+static unsigned int tcl_hash(const char *s, size_t len) {
+  unsigned int h = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+/* Dicts are lists of keys and values with a hash index on top, the index maps
+ * a key to the position of its pair. Any list of pairs is a dict and a dict is
+ * a list, so the string form is built lazily with the list quoting rules. Keys
+ * are unique and keep the order in which they were first added */
+static int tcl_dict_find(tcl_value_t *v, tcl_value_t *key, int *slot) {
+  unsigned int mask = v->index[0] - 1;
+  unsigned int i = tcl_hash(tcl_string(key), tcl_length(key)) & mask;
+  for (; v->index[i + 2] != 0; i = (i + 1) & mask) {
+    int pair = v->index[i + 2] - 1;
+    tcl_value_t *k = v->items[pair * 2];
+    if (tcl_length(k) == tcl_length(key) &&
+        memcmp(tcl_string(k), tcl_string(key), tcl_length(key)) == 0) {
+      *slot = i;
+      return pair;
+    }
+  }
+  *slot = i;
+  return -1;
+}
+
+/* Rebuilds the index, keeping it at most half full. A duplicate key gets the
+ * value of its last pair, as if the pairs were set in order, but the items are
+ * left alone: the value may be shared, so only tcl_dict_own() removes them */
+static void tcl_dict_index(tcl_value_t *v) {
+  int cap = 8;
+  while (cap < v->nitems) {
+    cap = cap * 2;
+  }
+  tcl_dict_drop(v);
+  v->index = v->mem->alloc(v->mem, (cap + 2) * sizeof(int));
+  memset(v->index, 0, (cap + 2) * sizeof(int));
+  v->index[0] = cap;
+  v->flags |= TCL_VALUE_DICT;
+  for (int i = 0; i < v->nitems; i += 2) {
+    int slot;
+    if (tcl_dict_find(v, v->items[i], &slot) < 0) {
+      v->index[1]++;
     }
-    v = tcl_append(v, tcl_dup(tail));
-    if (q) {
-      v = tcl_append(v, tcl_alloc("}", 1));
+    v->index[slot + 2] = i / 2 + 1;
+  }
+}
+
+/* Returns -1 if the value is not a list of pairs */
+static int tcl_dict_parse(tcl_value_t *v) {
+  if (v->flags & TCL_VALUE_DICT) {
+    return 0;
+  }
+  tcl_list_parse(v);
+  if (v->nitems % 2 != 0) {
+    return -1;
+  }
+  tcl_dict_index(v);
+  return 0;
+}
+
+static tcl_value_t *tcl_dict_get(tcl_value_t *v, tcl_value_t *key) {
+  int slot;
+  int pair = tcl_dict_find(v, key, &slot);
+  return (pair < 0 ? NULL : v->items[pair * 2 + 1]);
+}
+
+/* Sets the key of an owned dict to the value, the value is consumed */
+static void tcl_dict_set(tcl_value_t *v, tcl_value_t *key, tcl_value_t *val) {
+  int slot;
+  int pair = tcl_dict_find(v, key, &slot);
+  if (pair >= 0) {
+    tcl_free(v->items[pair * 2 + 1]);
+    v->items[pair * 2 + 1] = val;
+    return;
+  }
+  tcl_list_push(v, tcl_dup(key));
+  tcl_list_push(v, val);
+  if (v->nitems > v->index[0]) {
+    tcl_dict_index(v);
+  } else {
+    v->index[1]++;
+    v->index[slot + 2] = v->nitems / 2;
+  }
+}
+
+/* Makes a parsed dict safe to modify, copying it if it is shared or has
+ * duplicate keys. A duplicate key stays where it first appears */
+static tcl_value_t *tcl_dict_own(tcl_value_t *v) {
+  if (v->refs > 1 || v->index[1] * 2 != v->nitems) {
+    tcl_value_t *copy = tcl_value_alloc(v->mem, TCL_VALUE_LIST);
+    tcl_dict_index(copy);
+    for (int i = 0; i < v->nitems; i += 2) {
+      int slot;
+      if (tcl_dict_find(copy, v->items[i], &slot) < 0) {
+        tcl_value_t *last = tcl_dict_get(v, v->items[i]);
+        tcl_dict_set(copy, v->items[i], tcl_dup(last));
+      }
     }
+    tcl_free(v);
+    v = copy;
+  }
+  tcl_string_drop(v);
+  v->flags &= ~TCL_VALUE_INT;
+  return v;
+}
+
+/* Removing a key keeps the order of the others, so it takes linear time */
+static void tcl_dict_unset(tcl_value_t *v, tcl_value_t *key) {
+  int slot;
+  int pair = tcl_dict_find(v, key, &slot);
+  if (pair >= 0) {
+    tcl_free(v->items[pair * 2]);
+    tcl_free(v->items[pair * 2 + 1]);
+    memmove(&v->items[pair * 2], &v->items[pair * 2 + 2],
+            (v->nitems - pair * 2 - 2) * sizeof(tcl_value_t *));
+    v->nitems -= 2;
+    tcl_dict_index(v);
+  }
+}
+
+/* Follows the path of keys through nested dicts. Returns the value, or NULL if
+ * a key is missing or a value on the way is not a dict */
+static tcl_value_t *tcl_dict_path(tcl_value_t *v, tcl_value_t **keys, int n) {
+  for (int i = 0; i < n && v != NULL; i++) {
+    v = (tcl_dict_parse(v) < 0 ? NULL : tcl_dict_get(v, keys[i]));
+  }
+  return v;
+}
+
+/* Sets (or removes if val is NULL) the value at the end of the path. The dict
+ * and every existing dict on the path must be valid, missing ones are created
+ * when setting. Consumes the dict and returns the updated one */
+static tcl_value_t *tcl_dict_put(tcl_value_t *v, tcl_value_t **keys, int n,
+                                 tcl_value_t *val) {
+  v = tcl_dict_own(v);
+  if (n == 1 && val != NULL) {
+    tcl_dict_set(v, keys[0], tcl_dup(val));
+  } else if (n == 1) {
+    tcl_dict_unset(v, keys[0]);
   } else {
-    v = tcl_append(v, tcl_alloc("{}", 2));
+    int slot;
+    int pair = tcl_dict_find(v, keys[0], &slot);
+    if (pair >= 0) {
+      /* The nested dict is taken out, so that it can be updated in place */
+      tcl_value_t *inner = v->items[pair * 2 + 1];
+      tcl_dict_parse(inner);
+      v->items[pair * 2 + 1] = tcl_dict_put(inner, keys + 1, n - 1, val);
+    } else if (val != NULL) {
+      tcl_value_t *inner = tcl_value_alloc(v->mem, TCL_VALUE_LIST);
+      tcl_dict_index(inner);
+      tcl_dict_set(v, keys[0], tcl_dict_put(inner, keys + 1, n - 1, val));
+    }
   }
   return v;
 }
@@ -212,339 +859,2696 @@ tcl_value_t *tcl_list_append(tcl_value_t *v, tcl_value_t *tail) {
 /* ----------------------------- */
 /* ----------------------------- */
 
-typedef int (*tcl_cmd_fn_t)(struct tcl *, tcl_value_t *, void *);
+/* Scripts are compiled once into commands, words and word parts, so that
+ * loop and procedure bodies are not re-lexed every time they are evaluated */
+enum { PLITERAL, PVAR, PSUBST };
 
-struct tcl_cmd {
-  tcl_value_t *name;
-  int arity;
-  tcl_cmd_fn_t fn;
-  void *arg;
-  struct tcl_cmd *next;
-};
+#define TCL_CACHE_BUCKETS 64
+#define TCL_CACHE_MAX 256
 
-struct tcl_var {
-  tcl_value_t *name;
-  tcl_value_t *value;
-  struct tcl_var *next;
-};
+struct tcl_script;
 
-struct tcl_env {
-  struct tcl_var *vars;
-  struct tcl_env *parent;
+struct tcl_part {
+  int type;
+  tcl_value_t *value;        /* PLITERAL: word text, braces removed */
+  struct tcl_part *name;     /* PVAR: variable name */
+  int slot;                  /* PVAR: local variable index, or -1 */
+  unsigned int hash;         /* PVAR: hash of the literal variable name */
+  struct tcl_script *script; /* PSUBST: nested [...] script */
 };
 
-static struct tcl_env *tcl_env_alloc(struct tcl_env *parent) {
-  struct tcl_env *env = malloc(sizeof(*env));
-  env->vars = NULL;
-  env->parent = parent;
-  return env;
-}
+struct tcl_word {
+  struct tcl_part *parts;
+  int nparts;
+};
 
-static struct tcl_var *tcl_env_var(struct tcl_env *env, tcl_value_t *name) {
-  struct tcl_var *var = malloc(sizeof(struct tcl_var));
-  var->name = tcl_dup(name);
-  var->next = env->vars;
-  var->value = tcl_alloc("", 0);
-  env->vars = var;
-  return var;
-}
+struct tcl_command {
+  struct tcl_word *words;
+  int nwords;
+  int token; /* TCMD, or TERROR if the lexer failed inside this command */
+  struct tcl_cmd *cmd; /* Resolved command, valid while gen matches */
+  unsigned int gen;
+};
 
-static struct tcl_env *tcl_env_free(struct tcl_env *env) {
-  struct tcl_env *parent = env->parent;
-  while (env->vars) {
-    struct tcl_var *var = env->vars;
-    env->vars = env->vars->next;
-    tcl_free(var->name);
-    tcl_free(var->value);
-    free(var);
-  }
-  free(env);
-  return parent;
-}
+struct tcl_code;
 
-struct tcl {
-  struct tcl_env *env;
-  struct tcl_cmd *cmds;
-  tcl_value_t *result;
+struct tcl_script {
+  struct tcl_command *cmds;
+  int ncmds;
+  int refs;
+  struct tcl_code *code; /* Bytecode, compiled when first evaluated */
+  int nocode;            /* Set if the script can't be compiled */
+  unsigned int hash;
+  tcl_value_t *src; /* Cache key, NULL if the script is not cached */
+  struct tcl_script *next;
 };
 
-tcl_value_t *tcl_var(struct tcl *tcl, tcl_value_t *name, tcl_value_t *v) {
-  DBG("var(%s := %.*s)\n", tcl_string(name), tcl_length(v), tcl_string(v));
-  struct tcl_var *var;
-  for (var = tcl->env->vars; var != NULL; var = var->next) {
-    if (strcmp(var->name, tcl_string(name)) == 0) {
-      break;
-    }
-  }
-  if (var == NULL) {
-    var = tcl_env_var(tcl->env, name);
+/* Grows array of n items to the next power of two when it's full */
+static void *tcl_array_grow(void *p, int n, size_t size) {
+  if (n == 0 || (n & (n - 1)) == 0) {
+    p = realloc(p, (n == 0 ? 1 : 2 * n) * size);
   }
-  if (v != NULL) {
-    tcl_free(var->value);
-    var->value = tcl_dup(v);
-    tcl_free(v);
-  }
-  return var->value;
+  return p;
 }
 
-int tcl_result(struct tcl *tcl, int flow, tcl_value_t *result) {
-  DBG("tcl_result %.*s, flow=%d\n", tcl_length(result), tcl_string(result),
-      flow);
-  tcl_free(tcl->result);
-  tcl->result = result;
-  return flow;
-}
+static struct tcl_script *tcl_compile(const char *s, size_t len);
 
-int tcl_subst(struct tcl *tcl, const char *s, size_t len) {
-  DBG("subst(%.*s)\n", (int)len, s);
+static void tcl_compile_part(struct tcl_part *part, const char *s,
+                             size_t len) {
+  memset(part, 0, sizeof(*part));
+  part->type = PLITERAL;
+  part->slot = -1;
   if (len == 0) {
-    return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+    part->value = tcl_alloc("", 0);
+    return;
   }
   switch (s[0]) {
   case '{':
-    if (len <= 1) {
-      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
-    }
-    return tcl_result(tcl, FNORMAL, tcl_alloc(s + 1, len - 2));
-  case '$': {
-    if (len >= MAX_VAR_LENGTH) {
-      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
+    part->value = (len <= 1 ? tcl_alloc("", 0) : tcl_alloc(s + 1, len - 2));
+    break;
+  case '$':
+    part->type = PVAR;
+    part->name = malloc(sizeof(struct tcl_part));
+    tcl_compile_part(part->name, s + 1, len - 1);
+    if (part->name->type == PLITERAL) {
+      tcl_value_t *name = part->name->value;
+      part->hash = tcl_hash(tcl_string(name), tcl_length(name));
     }
-    char buf[5 + MAX_VAR_LENGTH] = "set ";
-    strncat(buf, s + 1, len - 1);
-    return tcl_eval(tcl, buf, strlen(buf) + 1);
-  }
+    break;
   case '[': {
     tcl_value_t *expr = tcl_alloc(s + 1, len - 2);
-    int r = tcl_eval(tcl, tcl_string(expr), tcl_length(expr) + 1);
+    part->type = PSUBST;
+    part->script = tcl_compile(tcl_string(expr), tcl_length(expr) + 1);
     tcl_free(expr);
-    return r;
+    break;
   }
   default:
-    return tcl_result(tcl, FNORMAL, tcl_alloc(s, len));
+    part->value = tcl_alloc(s, len);
   }
 }
 
-int tcl_eval(struct tcl *tcl, const char *s, size_t len) {
-  DBG("eval(%.*s)->\n", (int)len, s);
-  tcl_value_t *list = tcl_list_alloc();
-  tcl_value_t *cur = NULL;
+static struct tcl_script *tcl_compile(const char *s, size_t len) {
+  struct tcl_script *script = calloc(1, sizeof(struct tcl_script));
+  struct tcl_command *cmd = NULL;
+  struct tcl_word *word = NULL;
+  script->refs = 1;
   tcl_each(s, len, 1) {
-    DBG("tcl_next %d %.*s\n", p.token, (int)(p.to - p.from), p.from);
-    switch (p.token) {
-    case TERROR:
-      DBG("eval: FERROR, lexer error\n");
-      return tcl_result(tcl, FERROR, tcl_alloc("", 0));
-    case TWORD:
-      DBG("token %.*s, length=%d, cur=%p (3.1.1)\n", (int)(p.to - p.from),
-          p.from, (int)(p.to - p.from), cur);
-      if (cur != NULL) {
-        tcl_subst(tcl, p.from, p.to - p.from);
-        tcl_value_t *part = tcl_dup(tcl->result);
-        cur = tcl_append(cur, part);
-      } else {
-        tcl_subst(tcl, p.from, p.to - p.from);
-        cur = tcl_dup(tcl->result);
+    if (cmd == NULL) {
+      script->cmds = tcl_array_grow(script->cmds, script->ncmds, sizeof(*cmd));
+      cmd = &script->cmds[script->ncmds++];
+      memset(cmd, 0, sizeof(*cmd));
+      cmd->token = TERROR;
+    }
+    if (p.token == TWORD || p.token == TPART) {
+      if (word == NULL) {
+        cmd->words = tcl_array_grow(cmd->words, cmd->nwords, sizeof(*word));
+        word = &cmd->words[cmd->nwords++];
+        memset(word, 0, sizeof(*word));
+      }
+      word->parts =
+          tcl_array_grow(word->parts, word->nparts, sizeof(struct tcl_part));
+      tcl_compile_part(&word->parts[word->nparts++], p.from, p.to - p.from);
+      if (p.token == TWORD) {
+        word = NULL;
+      }
+    } else {
+      cmd->token = p.token;
+      cmd = NULL;
+      word = NULL;
+      if (p.token == TERROR) {
+        break;
+      }
+    }
+  }
+  return script;
+}
+
+static void tcl_script_release(struct tcl_script *script);
+static void tcl_code_free(struct tcl_code *code);
+
+static void tcl_part_free(struct tcl_part *part) {
+  tcl_free(part->value);
+  if (part->name != NULL) {
+    tcl_part_free(part->name);
+    free(part->name);
+  }
+  if (part->script != NULL) {
+    tcl_script_release(part->script);
+  }
+}
+
+static void tcl_script_release(struct tcl_script *script) {
+  if (--script->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < script->ncmds; i++) {
+    struct tcl_command *cmd = &script->cmds[i];
+    for (int j = 0; j < cmd->nwords; j++) {
+      for (int k = 0; k < cmd->words[j].nparts; k++) {
+        tcl_part_free(&cmd->words[j].parts[k]);
+      }
+      free(cmd->words[j].parts);
+    }
+    free(cmd->words);
+  }
+  free(script->cmds);
+  tcl_code_free(script->code);
+  tcl_free(script->src);
+  free(script);
+}
+
+/* ----------------------------- */
+/* ----------------------------- */
+/* ----------------------------- */
+/* ----------------------------- */
+
+/* Commands receive their arguments (including the command name) either as a
+ * list value or as an array of values. The array values are owned by the
+ * caller and are only valid until the command returns */
+typedef int (*tcl_cmd_fn_t)(struct tcl *, tcl_value_t *, void *);
+typedef int (*tcl_cmd_argv_fn_t)(struct tcl *, int, tcl_value_t **, void *);
+
+#ifdef TCL_ENABLE_PROFILE
+/* Self time and allocations exclude the nested commands, total time includes
+ * them, but counts each recursive activation only once */
+struct tcl_profile {
+  unsigned long calls;
+  unsigned long long total_ns;
+  unsigned long long self_ns;
+  unsigned long allocs;
+  int active; /* Calls in progress */
+};
+
+/* Allocations of a profiled interpreter are counted on top of its allocator,
+ * the values it creates must not outlive it */
+struct tcl_profile_mem {
+  struct tcl_allocator mem; /* Must be the first field */
+  struct tcl_allocator *parent;
+  unsigned long allocs;
+};
+
+static void *tcl_profile_alloc(struct tcl_allocator *mem, size_t size) {
+  struct tcl_profile_mem *counter = (struct tcl_profile_mem *)mem;
+  counter->allocs++;
+  return counter->parent->alloc(counter->parent, size);
+}
+
+static void *tcl_profile_realloc(struct tcl_allocator *mem, void *p,
+                                 size_t old, size_t size) {
+  struct tcl_profile_mem *counter = (struct tcl_profile_mem *)mem;
+  counter->allocs++;
+  return counter->parent->realloc(counter->parent, p, old, size);
+}
+
+static void tcl_profile_free(struct tcl_allocator *mem, void *p,
+                             size_t size) {
+  struct tcl_profile_mem *counter = (struct tcl_profile_mem *)mem;
+  counter->parent->free(counter->parent, p, size);
+}
+
+static struct tcl_allocator *tcl_profile_wrap(struct tcl_profile_mem *counter,
+                                              struct tcl_allocator *mem) {
+  if (mem->alloc == tcl_profile_alloc) {
+    mem = ((struct tcl_profile_mem *)mem)->parent;
+  }
+  counter->mem.alloc = tcl_profile_alloc;
+  counter->mem.realloc = tcl_profile_realloc;
+  counter->mem.free = tcl_profile_free;
+  counter->parent = mem;
+  counter->allocs = 0;
+  return &counter->mem;
+}
+#endif
+
+/* Command and variable names are interned: each interpreter keeps one atom per
+ * distinct name, with its hash computed once. Environments and the command
+ * table compare atoms by pointer, and compiled code binds its names to atoms
+ * on first use, so looking up a name in the hot path needs no hashing and no
+ * string comparison. Atoms are reference counted and know their table, so
+ * whoever holds one can release it */
+#define TCL_ATOMS_MIN 64
+
+struct tcl_atoms;
+
+struct tcl_atom {
+  tcl_value_t *name;
+  unsigned int hash;
+  int refs;
+  struct tcl_atom *next; /* Next atom in the same bucket */
+  struct tcl_atoms *table;
+};
+
+struct tcl_atoms {
+  struct tcl_allocator *mem;
+  struct tcl_atom **buckets;
+  int count;
+  int cap;
+};
+
+static void tcl_atoms_init(struct tcl_atoms *atoms,
+                           struct tcl_allocator *mem) {
+  atoms->mem = mem;
+  atoms->buckets = calloc(TCL_ATOMS_MIN, sizeof(struct tcl_atom *));
+  atoms->count = 0;
+  atoms->cap = TCL_ATOMS_MIN;
+}
+
+/* Returns the atom of the name, or NULL if there is none. With create set, the
+ * atom is made if needed and returned with a new reference */
+static struct tcl_atom *tcl_atom_lookup(struct tcl_atoms *atoms,
+                                        const char *s, size_t len,
+                                        unsigned int h, int create) {
+  struct tcl_atom **bucket = &atoms->buckets[h & (atoms->cap - 1)];
+  struct tcl_atom *atom;
+  for (atom = *bucket; atom != NULL; atom = atom->next) {
+    if (atom->hash == h && (size_t)atom->name->len == len &&
+        memcmp(atom->name->data, s, len) == 0) {
+      atom->refs += create;
+      return atom;
+    }
+  }
+  if (!create) {
+    return NULL;
+  }
+  if (atoms->count == atoms->cap) {
+    int cap = atoms->cap * 2;
+    struct tcl_atom **buckets = calloc(cap, sizeof(struct tcl_atom *));
+    for (int i = 0; i < atoms->cap; i++) {
+      while ((atom = atoms->buckets[i]) != NULL) {
+        atoms->buckets[i] = atom->next;
+        atom->next = buckets[atom->hash & (cap - 1)];
+        buckets[atom->hash & (cap - 1)] = atom;
+      }
+    }
+    free(atoms->buckets);
+    atoms->buckets = buckets;
+    atoms->cap = cap;
+    bucket = &atoms->buckets[h & (cap - 1)];
+  }
+  atom = atoms->mem->alloc(atoms->mem, sizeof(struct tcl_atom));
+  /* The atom has its own copy of the name, so nobody can change it */
+  atom->name = tcl_value_new(atoms->mem, s, len);
+  atom->hash = h;
+  atom->refs = 1;
+  atom->table = atoms;
+  atom->next = *bucket;
+  *bucket = atom;
+  atoms->count++;
+  return atom;
+}
+
+static struct tcl_atom *tcl_atom(struct tcl_atoms *atoms, tcl_value_t *name) {
+  const char *s = tcl_string(name);
+  return tcl_atom_lookup(atoms, s, tcl_length(name),
+                         tcl_hash(s, tcl_length(name)), 1);
+}
+
+static struct tcl_atom *tcl_atom_dup(struct tcl_atom *atom) {
+  atom->refs++;
+  return atom;
+}
+
+static void tcl_atom_release(struct tcl_atom *atom) {
+  if (atom == NULL || --atom->refs > 0) {
+    return;
+  }
+  struct tcl_atoms *atoms = atom->table;
+  struct tcl_atom **p = &atoms->buckets[atom->hash & (atoms->cap - 1)];
+  while (*p != atom) {
+    p = &(*p)->next;
+  }
+  *p = atom->next;
+  atoms->count--;
+  tcl_free(atom->name);
+  atoms->mem->free(atoms->mem, atom, sizeof(struct tcl_atom));
+}
+
+struct tcl_cmd {
+  struct tcl_atom *name;
+  int arity;
+  tcl_cmd_fn_t fn;
+  tcl_cmd_argv_fn_t argv_fn;
+  void *arg;
+  struct tcl_cmd *next;
+#ifdef TCL_ENABLE_PROFILE
+  struct tcl_profile profile;
+#endif
+};
+
+#define TCL_ENV_INLINE 8
+
+struct tcl_var {
+  struct tcl_atom *name;
+  tcl_value_t *value;
+};
+
+/* Variables are stored in the order of creation, so each variable keeps its
+ * index (slot) for the whole lifetime of the environment. Small environments
+ * are searched linearly in the inline array, larger ones get a hash index */
+struct tcl_env {
+  struct tcl_var *vars;
+  int nvars;
+  int cap;
+  int *index; /* Open-addressing table of variable index + 1, 0 if empty */
+  int indexcap;
+  struct tcl_env *parent;
+  struct tcl_var inline_vars[TCL_ENV_INLINE];
+};
+
+static void tcl_env_init(struct tcl_env *env, struct tcl_env *parent) {
+  env->vars = env->inline_vars;
+  env->nvars = 0;
+  env->cap = TCL_ENV_INLINE;
+  env->index = NULL;
+  env->indexcap = 0;
+  env->parent = parent;
+}
+
+static struct tcl_env *tcl_env_alloc(struct tcl_allocator *mem,
+                                     struct tcl_env *parent) {
+  struct tcl_env *env = mem->alloc(mem, sizeof(*env));
+  tcl_env_init(env, parent);
+  return env;
+}
+
+static int tcl_env_find(struct tcl_env *env, struct tcl_atom *name) {
+  if (env->index == NULL) {
+    for (int i = 0; i < env->nvars; i++) {
+      if (env->vars[i].name == name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+  unsigned int mask = env->indexcap - 1;
+  for (unsigned int i = name->hash & mask; env->index[i] != 0;
+       i = (i + 1) & mask) {
+    if (env->vars[env->index[i] - 1].name == name) {
+      return env->index[i] - 1;
+    }
+  }
+  return -1;
+}
+
+static void tcl_env_index(struct tcl_env *env, int n) {
+  unsigned int mask = env->indexcap - 1;
+  unsigned int i = env->vars[n].name->hash & mask;
+  while (env->index[i] != 0) {
+    i = (i + 1) & mask;
+  }
+  env->index[i] = n + 1;
+}
+
+static struct tcl_var *tcl_env_var(struct tcl_allocator *mem,
+                                   struct tcl_env *env, struct tcl_atom *name,
+                                   tcl_value_t *empty) {
+  if (env->nvars == env->cap) {
+    size_t size = env->cap * sizeof(struct tcl_var);
+    env->cap = env->cap * 2;
+    if (env->vars == env->inline_vars) {
+      env->vars = mem->alloc(mem, 2 * size);
+      memcpy(env->vars, env->inline_vars, sizeof(env->inline_vars));
+    } else {
+      env->vars = mem->realloc(mem, env->vars, size, 2 * size);
+    }
+  }
+  struct tcl_var *var = &env->vars[env->nvars++];
+  var->name = tcl_atom_dup(name);
+  var->value = tcl_dup(empty);
+  if (env->nvars > TCL_ENV_INLINE && env->nvars * 2 > env->indexcap) {
+    mem->free(mem, env->index, env->indexcap * sizeof(int));
+    env->indexcap = 2 * env->cap;
+    env->index = mem->alloc(mem, env->indexcap * sizeof(int));
+    memset(env->index, 0, env->indexcap * sizeof(int));
+    for (int i = 0; i < env->nvars; i++) {
+      tcl_env_index(env, i);
+    }
+  } else if (env->index != NULL) {
+    tcl_env_index(env, env->nvars - 1);
+  }
+  return var;
+}
+
+/* Releases the variables, returns the parent environment */
+static struct tcl_env *tcl_env_clear(struct tcl_allocator *mem,
+                                     struct tcl_env *env) {
+  for (int i = 0; i < env->nvars; i++) {
+    tcl_atom_release(env->vars[i].name);
+    tcl_free(env->vars[i].value);
+  }
+  if (env->vars != env->inline_vars) {
+    mem->free(mem, env->vars, env->cap * sizeof(struct tcl_var));
+  }
+  mem->free(mem, env->index, env->indexcap * sizeof(int));
+  return env->parent;
+}
+
+static struct tcl_env *tcl_env_free(struct tcl_allocator *mem,
+                                    struct tcl_env *env) {
+  struct tcl_env *parent = tcl_env_clear(mem, env);
+  mem->free(mem, env, sizeof(*env));
+  return parent;
+}
+
+/* Procedure environments come and go in LIFO order, so they are bump-allocated
+ * from chunks kept by the interpreter rather than taken from the allocator on
+ * every call. An emptied chunk is kept as a spare, so that calls going back
+ * and forth across a chunk boundary don't allocate */
+#define TCL_ARENA_ENVS 32
+
+struct tcl_arena {
+  struct tcl_arena *prev;
+  int used;
+  struct tcl_env envs[TCL_ARENA_ENVS];
+};
+
+/* Commands are kept in an open-addressing hash table, each slot holds a chain
+ * of commands with the same name, most recently registered first */
+#define TCL_CMDS_MIN 32
+
+#ifndef TCL_MAX_DEPTH
+#define TCL_MAX_DEPTH 1000
+#endif
+#define TCL_TICKS_MAX 0x7fffffffL
+
+/* Reasons for stopping a script, see tcl_set_budget() and tcl_set_hook() */
+enum { TCL_ABORT_NONE, TCL_ABORT_BUDGET, TCL_ABORT_DEPTH, TCL_ABORT_HOOK };
+
+struct tcl {
+  struct tcl_allocator *mem; /* Used for values and environments */
+  tcl_value_t *empty;        /* Shared empty string */
+  struct tcl_atoms atoms;    /* Interned names */
+  struct tcl_env *env;
+  struct tcl_arena *arena; /* Environments of the running procedures */
+  struct tcl_arena *spare;
+  struct tcl_cmd **cmds;
+  int ncmds;
+  int cmdcap;
+  unsigned int cmdgen; /* Changes every time a command is registered */
+  tcl_value_t *result;
+  struct tcl_script **cache;
+  int ncache;
+  struct tcl_expr **exprs;
+  int nexprs;
+  int depth;    /* Nested command calls */
+  int maxdepth; /* Calls nested deeper fail */
+  long budget;  /* Commands left, or -1 if unlimited */
+  long ticks;   /* Commands until the limits are checked again */
+  long period;  /* Commands between the two checks */
+  long every;   /* Commands between the hook calls */
+  long untilhook;
+  int (*hook)(struct tcl *tcl, void *arg);
+  void *hookarg;
+  int aborted; /* Why the script was stopped, TCL_ABORT_NONE if it wasn't */
+  long stack;  /* Bytes of procedure frames allowed on the heap, or 0 if
+                  procedures are nested on the C stack */
+  long stackused;
+#ifdef TCL_ENABLE_PROFILE
+  struct tcl_profile_mem counter; /* Counts allocations of the interpreter */
+  unsigned long long nested_ns;   /* Spent in the commands called by the
+                                     current one */
+  unsigned long nested_allocs;
+#endif
+};
+
+static tcl_value_t *tcl_empty(struct tcl *tcl) { return tcl_dup(tcl->empty); }
+
+/* Enters a new procedure environment */
+static void tcl_env_push(struct tcl *tcl, struct tcl_env *parent) {
+  struct tcl_arena *a = tcl->arena;
+  if (a == NULL || a->used == TCL_ARENA_ENVS) {
+    a = tcl->spare;
+    tcl->spare = NULL;
+    if (a == NULL) {
+      a = tcl->mem->alloc(tcl->mem, sizeof(*a));
+    }
+    a->prev = tcl->arena;
+    a->used = 0;
+    tcl->arena = a;
+  }
+  tcl->env = &a->envs[a->used++];
+  tcl_env_init(tcl->env, parent);
+}
+
+/* Leaves the procedure environment, which is the last one pushed */
+static void tcl_env_pop(struct tcl *tcl) {
+  struct tcl_arena *a = tcl->arena;
+  tcl->env = tcl_env_clear(tcl->mem, tcl->env);
+  if (--a->used == 0) {
+    tcl->arena = a->prev;
+    if (tcl->spare != NULL) {
+      tcl->mem->free(tcl->mem, tcl->spare, sizeof(*a));
+    }
+    tcl->spare = a;
+  }
+}
+
+static tcl_value_t *tcl_var_atom(struct tcl *tcl, struct tcl_atom *name,
+                                 tcl_value_t *v) {
+  int i = tcl_env_find(tcl->env, name);
+  struct tcl_var *var =
+      (i < 0 ? tcl_env_var(tcl->mem, tcl->env, name, tcl->empty)
+             : &tcl->env->vars[i]);
+  if (v != NULL) {
+    tcl_free(var->value);
+    var->value = v;
+  }
+  return var->value;
+}
+
+static tcl_value_t *tcl_var_value(struct tcl *tcl, tcl_value_t *name,
+                                  tcl_value_t *v) {
+  DBG("var(%s := %.*s)\n", tcl_string(name), tcl_length(v), tcl_string(v));
+  struct tcl_atom *atom = tcl_atom(&tcl->atoms, name);
+  tcl_value_t *r = tcl_var_atom(tcl, atom, v);
+  tcl_atom_release(atom);
+  return r;
+}
+
+/* Names in compiled code are bound to the atoms of the interpreter that runs
+ * the code when they are first used */
+static struct tcl_atom *tcl_atom_bind(struct tcl *tcl, struct tcl_atom **atom,
+                                      tcl_value_t *name) {
+  if (*atom == NULL) {
+    *atom = tcl_atom(&tcl->atoms, name);
+  }
+  return *atom;
+}
+
+tcl_value_t *tcl_var(struct tcl *tcl, const char *name, tcl_value_t *v) {
+  tcl_value_t *s = tcl_value_new(tcl->mem, name, strlen(name));
+  tcl_value_t *r = tcl_var_value(tcl, s, v);
+  tcl_free(s);
+  return r;
+}
+
+int tcl_result(struct tcl *tcl, int flow, tcl_value_t *result) {
+  DBG("tcl_result %.*s, flow=%d\n", tcl_length(result), tcl_string(result),
+      flow);
+  tcl_free(tcl->result);
+  tcl->result = result;
+  return flow;
+}
+
+/* Sets the result to the variable value, missing variables are read as empty
+ * strings but not created */
+static int tcl_var_result(struct tcl *tcl, const char *name, size_t len,
+                          unsigned int h) {
+  struct tcl_atom *atom = tcl_atom_lookup(&tcl->atoms, name, len, h, 0);
+  int i = (atom == NULL ? -1 : tcl_env_find(tcl->env, atom));
+  if (i < 0) {
+    return tcl_result(tcl, FNORMAL, tcl_empty(tcl));
+  }
+  return tcl_result(tcl, FNORMAL, tcl_dup(tcl->env->vars[i].value));
+}
+
+int tcl_subst(struct tcl *tcl, const char *s, size_t len) {
+  DBG("subst(%.*s)\n", (int)len, s);
+  if (len == 0) {
+    return tcl_result(tcl, FNORMAL, tcl_empty(tcl));
+  }
+  switch (s[0]) {
+  case '{':
+    if (len <= 1) {
+      return tcl_result(tcl, FERROR, tcl_empty(tcl));
+    }
+    return tcl_result(tcl, FNORMAL, tcl_value_new(tcl->mem, s + 1, len - 2));
+  case '$': {
+    tcl_subst(tcl, s + 1, len - 1);
+    const char *name = tcl_string(tcl->result);
+    size_t n = tcl_length(tcl->result);
+    return tcl_var_result(tcl, name, n, tcl_hash(name, n));
+  }
+  case '[': {
+    tcl_value_t *expr = tcl_value_new(tcl->mem, s + 1, len - 2);
+    int r = tcl_eval(tcl, tcl_string(expr), tcl_length(expr) + 1);
+    tcl_free(expr);
+    return r;
+  }
+  default:
+    return tcl_result(tcl, FNORMAL, tcl_value_new(tcl->mem, s, len));
+  }
+}
+
+static struct tcl_cmd **tcl_cmd_slot(struct tcl_cmd **cmds, int cap,
+                                     struct tcl_atom *name) {
+  unsigned int mask = cap - 1;
+  for (unsigned int i = name->hash & mask;; i = (i + 1) & mask) {
+    if (cmds[i] == NULL || cmds[i]->name == name) {
+      return &cmds[i];
+    }
+  }
+}
+
+static struct tcl_cmd *tcl_lookup(struct tcl *tcl, tcl_value_t *name,
+                                  int arity) {
+  const char *s = tcl_string(name);
+  size_t len = tcl_length(name);
+  struct tcl_atom *atom =
+      tcl_atom_lookup(&tcl->atoms, s, len, tcl_hash(s, len), 0);
+  if (tcl->cmdcap == 0 || atom == NULL) {
+    return NULL;
+  }
+  struct tcl_cmd *cmd = *tcl_cmd_slot(tcl->cmds, tcl->cmdcap, atom);
+  for (; cmd != NULL; cmd = cmd->next) {
+    if (cmd->arity == 0 || cmd->arity == arity) {
+      return cmd;
+    }
+  }
+  return NULL;
+}
+
+static int tcl_exec(struct tcl *tcl, struct tcl_script *script);
+
+static int tcl_exec_part(struct tcl *tcl, struct tcl_part *part) {
+  switch (part->type) {
+  case PVAR: {
+    if (part->slot >= 0) {
+      struct tcl_var *var = &tcl->env->vars[part->slot];
+      return tcl_result(tcl, FNORMAL, tcl_dup(var->value));
+    }
+    if (part->name->type == PLITERAL) {
+      tcl_value_t *name = part->name->value;
+      return tcl_var_result(tcl, tcl_string(name), tcl_length(name),
+                            part->hash);
+    }
+    tcl_exec_part(tcl, part->name);
+    const char *name = tcl_string(tcl->result);
+    size_t n = tcl_length(tcl->result);
+    return tcl_var_result(tcl, name, n, tcl_hash(name, n));
+  }
+  case PSUBST:
+    return tcl_exec(tcl, part->script);
+  default:
+    return tcl_result(tcl, FNORMAL, tcl_dup(part->value));
+  }
+}
+
+/* Limits are checked only every few commands: ticks counts down to the
+ * nearest point where the budget runs out or the hook is due */
+static void tcl_ticks_reset(struct tcl *tcl) {
+  long period = TCL_TICKS_MAX;
+  if (tcl->budget >= 0 && tcl->budget < period) {
+    period = (tcl->budget > 0 ? tcl->budget : 1);
+  }
+  if (tcl->hook != NULL && tcl->untilhook < period) {
+    period = tcl->untilhook;
+  }
+  tcl->ticks = tcl->period = (tcl->aborted ? 1 : period);
+}
+
+static void tcl_abort(struct tcl *tcl, int reason) {
+  tcl->aborted = reason;
+  tcl_ticks_reset(tcl);
+}
+
+/* Called when ticks runs out, the current command is the last one of the
+ * period. An aborted script fails every command until it unwinds, the next
+ * top-level command clears the abort */
+static int tcl_tick(struct tcl *tcl) {
+  if (tcl->aborted && tcl->depth > 0) {
+    tcl_ticks_reset(tcl);
+    return FERROR;
+  }
+  tcl->aborted = TCL_ABORT_NONE;
+  if (tcl->budget >= 0) {
+    if (tcl->budget < tcl->period) {
+      tcl_abort(tcl, TCL_ABORT_BUDGET);
+      return FERROR;
+    }
+    tcl->budget -= tcl->period;
+  }
+  if (tcl->hook != NULL) {
+    tcl->untilhook -= tcl->period;
+    if (tcl->untilhook <= 0) {
+      tcl->untilhook = tcl->every;
+      if (tcl->hook(tcl, tcl->hookarg) != 0) {
+        tcl_abort(tcl, TCL_ABORT_HOOK);
+        return FERROR;
+      }
+    }
+  }
+  tcl_ticks_reset(tcl);
+  return FNORMAL;
+}
+
+static int tcl_call_cmd(struct tcl *tcl, struct tcl_cmd *cmd, int argc,
+                        tcl_value_t **argv) {
+  if (--tcl->ticks <= 0 && tcl_tick(tcl) != FNORMAL) {
+    return FERROR;
+  }
+  if (tcl->depth >= tcl->maxdepth) {
+    tcl_abort(tcl, TCL_ABORT_DEPTH);
+    return FERROR;
+  }
+  int r;
+  tcl->depth++;
+  if (cmd->argv_fn != NULL) {
+    r = cmd->argv_fn(tcl, argc, argv, cmd->arg);
+  } else {
+    tcl_value_t *list = tcl_list_alloc();
+    for (int i = 0; i < argc; i++) {
+      list = tcl_list_append(list, argv[i]);
+    }
+    r = cmd->fn(tcl, list, cmd->arg);
+    tcl_list_free(list);
+  }
+  tcl->depth--;
+  return r;
+}
+
+#ifdef TCL_ENABLE_PROFILE
+static unsigned long long tcl_profile_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ull +
+         (unsigned long long)ts.tv_nsec;
+}
+
+/* A call in progress, with the counters of its caller */
+struct tcl_profile_call {
+  unsigned long long start;
+  unsigned long long nested_ns;
+  unsigned long nested_allocs;
+  unsigned long allocs;
+};
+
+static void tcl_profile_begin(struct tcl *tcl, struct tcl_cmd *cmd,
+                              struct tcl_profile_call *call) {
+  call->nested_ns = tcl->nested_ns;
+  call->nested_allocs = tcl->nested_allocs;
+  call->allocs = tcl->counter.allocs;
+  tcl->nested_ns = 0;
+  tcl->nested_allocs = 0;
+  cmd->profile.active++;
+  call->start = tcl_profile_now();
+}
+
+static void tcl_profile_end(struct tcl *tcl, struct tcl_cmd *cmd,
+                            struct tcl_profile_call *call) {
+  struct tcl_profile *p = &cmd->profile;
+  unsigned long long ns = tcl_profile_now() - call->start;
+  unsigned long allocs = tcl->counter.allocs - call->allocs;
+  p->active--;
+  p->calls++;
+  p->self_ns += ns - tcl->nested_ns;
+  p->allocs += allocs - tcl->nested_allocs;
+  if (p->active == 0) {
+    p->total_ns += ns;
+  }
+  tcl->nested_ns = call->nested_ns + ns;
+  tcl->nested_allocs = call->nested_allocs + allocs;
+}
+
+static int tcl_call(struct tcl *tcl, struct tcl_cmd *cmd, int argc,
+                    tcl_value_t **argv) {
+  struct tcl_profile_call call;
+  tcl_profile_begin(tcl, cmd, &call);
+  int r = tcl_call_cmd(tcl, cmd, argc, argv);
+  tcl_profile_end(tcl, cmd, &call);
+  return r;
+}
+#else
+#define tcl_call tcl_call_cmd
+#endif
+
+#define TCL_ARGV_INLINE 8
+
+static int tcl_exec(struct tcl *tcl, struct tcl_script *script) {
+  for (int i = 0; i < script->ncmds; i++) {
+    struct tcl_command *cmd = &script->cmds[i];
+    tcl_value_t *buf[TCL_ARGV_INLINE];
+    tcl_value_t **argv = buf;
+    if (cmd->nwords > TCL_ARGV_INLINE) {
+      argv = malloc(cmd->nwords * sizeof(tcl_value_t *));
+    }
+    for (int j = 0; j < cmd->nwords; j++) {
+      tcl_value_t *cur = NULL;
+      for (int k = 0; k < cmd->words[j].nparts; k++) {
+        tcl_exec_part(tcl, &cmd->words[j].parts[k]);
+        if (cur == NULL) {
+          cur = tcl_dup(tcl->result);
+        } else {
+          cur = tcl_append_string(cur, tcl_string(tcl->result),
+                                  tcl_length(tcl->result));
+        }
+      }
+      argv[j] = (cur == NULL ? tcl_empty(tcl) : cur);
+    }
+    int r = FNORMAL;
+    if (cmd->token == TERROR) {
+      DBG("eval: FERROR, lexer error\n");
+      r = tcl_result(tcl, FERROR, tcl_empty(tcl));
+    } else if (cmd->nwords == 0) {
+      tcl_result(tcl, FNORMAL, tcl_empty(tcl));
+    } else {
+      struct tcl_cmd *c = cmd->cmd;
+      if (cmd->gen != tcl->cmdgen) {
+        c = tcl_lookup(tcl, argv[0], cmd->nwords);
+        /* Only literal command names can be resolved once and for all */
+        if (cmd->words[0].nparts == 1 &&
+            cmd->words[0].parts[0].type == PLITERAL) {
+          cmd->cmd = c;
+          cmd->gen = tcl->cmdgen;
+        }
+      }
+      r = (c == NULL ? FERROR : tcl_call(tcl, c, cmd->nwords, argv));
+    }
+    for (int j = 0; j < cmd->nwords; j++) {
+      tcl_free(argv[j]);
+    }
+    if (argv != buf) {
+      free(argv);
+    }
+    if (r != FNORMAL) {
+      return r;
+    }
+  }
+  return FNORMAL;
+}
+
+/* Expressions are parsed once into postfix code for a small machine working on
+ * native integers. Operands are numbers, variables ($name or ${name}) and
+ * nested scripts ([...]), operators are the ones of C (except assignments)
+ * with the same precedence. Division truncates towards zero, as in C */
+enum {
+  EX_NUM,  /* n: push a number */
+  EX_VAR,  /* name: push a variable by its name */
+  EX_SLOT, /* slot: push a local variable */
+  EX_CMD,  /* script: push the result of a nested script */
+  EX_NEG,
+  EX_NOT,
+  EX_BNOT,
+  EX_MUL,
+  EX_DIV,
+  EX_MOD,
+  EX_ADD,
+  EX_SUB,
+  EX_SHL,
+  EX_SHR,
+  EX_LT,
+  EX_GT,
+  EX_LE,
+  EX_GE,
+  EX_EQ,
+  EX_NE,
+  EX_BAND,
+  EX_BXOR,
+  EX_BOR,
+  EX_AND,   /* pc: jump if the top is zero, otherwise pop it */
+  EX_OR,    /* pc: jump if the top is non-zero (made 1), otherwise pop it */
+  EX_BOOL,  /* turn the top into 0 or 1 */
+  EX_JUMPZ, /* pc: pop the top and jump if it is zero */
+  EX_JUMP   /* pc */
+};
+
+#define TCL_EXPR_DEPTH 256 /* Nested parentheses and unary operators */
+#define TCL_STACK_INLINE 16
+
+struct tcl_proc {
+  tcl_value_t **params;
+  struct tcl_atom **atoms; /* Parameter names, interned */
+  int nparams;
+  struct tcl_script *body; /* Only kept if the body can't be compiled */
+  struct tcl_code *code;
+};
+
+struct tcl_expr {
+  int *ops;
+  int nops;
+  tcl_value_t **names;
+  struct tcl_atom **atoms; /* Names bound to atoms on first use */
+  int nnames;
+  struct tcl_script **scripts;
+  int nscripts;
+  int maxstack;
+  int refs;
+  unsigned int hash;
+  tcl_value_t *src; /* Cache key, NULL if the expression is not cached */
+  struct tcl_expr *next;
+};
+
+struct tcl_expr_parser {
+  const char *s;
+  const char *end;
+  struct tcl_expr *expr;
+  struct tcl_proc *proc; /* Procedure whose parameters are in slots, or NULL */
+  int depth;             /* Stack depth at the current instruction */
+  int nesting;
+  int ok;
+};
+
+static const struct {
+  char op[3];
+  int prec;
+  int code;
+} tcl_expr_ops[] = {
+    {"||", 1, EX_OR},  {"&&", 2, EX_AND}, {"==", 6, EX_EQ},  {"!=", 6, EX_NE},
+    {"<=", 7, EX_LE},  {">=", 7, EX_GE},  {"<<", 8, EX_SHL}, {">>", 8, EX_SHR},
+    {"|", 3, EX_BOR},  {"^", 4, EX_BXOR}, {"&", 5, EX_BAND}, {"<", 7, EX_LT},
+    {">", 7, EX_GT},   {"+", 9, EX_ADD},  {"-", 9, EX_SUB},  {"*", 10, EX_MUL},
+    {"/", 10, EX_DIV}, {"%", 10, EX_MOD},
+};
+
+static int tcl_proc_slot(struct tcl_proc *proc, tcl_value_t *name);
+static int tcl_run(struct tcl *tcl, struct tcl_script *script);
+
+static int tcl_expr_emit(struct tcl_expr_parser *p, int op) {
+  struct tcl_expr *expr = p->expr;
+  expr->ops = tcl_array_grow(expr->ops, expr->nops, sizeof(int));
+  expr->ops[expr->nops] = op;
+  return expr->nops++;
+}
+
+static void tcl_expr_stack(struct tcl_expr_parser *p, int n) {
+  p->depth += n;
+  if (p->depth > p->expr->maxstack) {
+    p->expr->maxstack = p->depth;
+  }
+}
+
+static void tcl_expr_space(struct tcl_expr_parser *p) {
+  while (p->s < p->end && (tcl_is_space(*p->s) || *p->s == '\n' ||
+                           *p->s == '\r')) {
+    p->s++;
+  }
+}
+
+static int tcl_expr_char(struct tcl_expr_parser *p, char c) {
+  tcl_expr_space(p);
+  if (p->s < p->end && *p->s == c) {
+    p->s++;
+    return 1;
+  }
+  return 0;
+}
+
+static void tcl_expr_var(struct tcl_expr_parser *p) {
+  struct tcl_expr *expr = p->expr;
+  const char *from = p->s;
+  const char *to;
+  if (p->s < p->end && *p->s == '{') {
+    from = ++p->s;
+    while (p->s < p->end && *p->s != '}') {
+      p->s++;
+    }
+    to = p->s;
+    p->ok = p->ok && (p->s++ < p->end);
+  } else {
+    while (p->s < p->end && (*p->s == '_' || (*p->s >= '0' && *p->s <= '9') ||
+                             (*p->s >= 'a' && *p->s <= 'z') ||
+                             (*p->s >= 'A' && *p->s <= 'Z'))) {
+      p->s++;
+    }
+    to = p->s;
+  }
+  tcl_value_t *name = tcl_alloc(from, to - from);
+  int slot = (p->proc == NULL ? -1 : tcl_proc_slot(p->proc, name));
+  p->ok = p->ok && (to > from);
+  if (slot >= 0) {
+    tcl_expr_emit(p, EX_SLOT);
+    tcl_expr_emit(p, slot);
+    tcl_free(name);
+  } else {
+    expr->names = tcl_array_grow(expr->names, expr->nnames,
+                                 sizeof(tcl_value_t *));
+    expr->names[expr->nnames] = name;
+    tcl_expr_emit(p, EX_VAR);
+    tcl_expr_emit(p, expr->nnames++);
+  }
+}
+
+/* Nested scripts end at the matching bracket, just like in the lexer */
+static void tcl_expr_script(struct tcl_expr_parser *p) {
+  struct tcl_expr *expr = p->expr;
+  const char *s = p->s;
+  size_t n = p->end - s;
+  size_t i = 0;
+  for (int depth = 1; depth > 0; i++) {
+    i += tcl_scan_pair(s + i, n - i, '[', ']');
+    if (i >= n) {
+      p->ok = 0;
+      return;
+    }
+    depth += (s[i] == '[' ? 1 : -1);
+  }
+  p->s = s + i;
+  tcl_value_t *body = tcl_alloc(s, i - 1);
+  expr->scripts = tcl_array_grow(expr->scripts, expr->nscripts,
+                                 sizeof(struct tcl_script *));
+  expr->scripts[expr->nscripts] =
+      tcl_compile(tcl_string(body), tcl_length(body) + 1);
+  tcl_free(body);
+  tcl_expr_emit(p, EX_CMD);
+  tcl_expr_emit(p, expr->nscripts++);
+}
+
+static void tcl_expr_parse(struct tcl_expr_parser *p);
+
+static void tcl_expr_operand(struct tcl_expr_parser *p) {
+  tcl_expr_space(p);
+  char c = (p->s < p->end ? *p->s : '\0');
+  if (c == '-' || c == '+' || c == '!' || c == '~') {
+    p->s++;
+    if (++p->nesting > TCL_EXPR_DEPTH) {
+      p->ok = 0;
+      return;
+    }
+    tcl_expr_operand(p);
+    p->nesting--;
+    if (c != '+') {
+      tcl_expr_emit(p, (c == '-' ? EX_NEG : c == '!' ? EX_NOT : EX_BNOT));
+    }
+    return;
+  }
+  if (p->s < p->end) {
+    p->s++;
+  }
+  if (c == '(') {
+    tcl_expr_parse(p);
+    p->ok = p->ok && tcl_expr_char(p, ')');
+    return;
+  }
+  tcl_expr_stack(p, 1);
+  if (c >= '0' && c <= '9') {
+    unsigned int n = (unsigned int)(c - '0');
+    while (p->s < p->end && *p->s >= '0' && *p->s <= '9') {
+      n = n * 10 + (unsigned int)(*p->s++ - '0');
+    }
+    tcl_expr_emit(p, EX_NUM);
+    tcl_expr_emit(p, (int)n);
+  } else if (c == '$') {
+    tcl_expr_var(p);
+  } else if (c == '[') {
+    tcl_expr_script(p);
+  } else {
+    p->ok = 0;
+  }
+}
+
+static int tcl_expr_op(struct tcl_expr_parser *p) {
+  tcl_expr_space(p);
+  for (unsigned int i = 0; i < sizeof(tcl_expr_ops) / sizeof(tcl_expr_ops[0]);
+       i++) {
+    size_t len = strlen(tcl_expr_ops[i].op);
+    if ((size_t)(p->end - p->s) >= len &&
+        memcmp(p->s, tcl_expr_ops[i].op, len) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/* Operators of the same precedence are parsed in a loop (left to right),
+ * higher precedence ones recursively */
+static void tcl_expr_binary(struct tcl_expr_parser *p, int prec) {
+  tcl_expr_operand(p);
+  for (int i; p->ok && (i = tcl_expr_op(p)) >= 0 &&
+              tcl_expr_ops[i].prec >= prec;) {
+    int code = tcl_expr_ops[i].code;
+    p->s += strlen(tcl_expr_ops[i].op);
+    if (code == EX_AND || code == EX_OR) {
+      tcl_expr_emit(p, code);
+      int skip = tcl_expr_emit(p, 0);
+      tcl_expr_stack(p, -1);
+      tcl_expr_binary(p, tcl_expr_ops[i].prec + 1);
+      tcl_expr_emit(p, EX_BOOL);
+      p->expr->ops[skip] = p->expr->nops;
+    } else {
+      tcl_expr_binary(p, tcl_expr_ops[i].prec + 1);
+      tcl_expr_emit(p, code);
+      tcl_expr_stack(p, -1);
+    }
+  }
+}
+
+static void tcl_expr_parse(struct tcl_expr_parser *p) {
+  if (++p->nesting > TCL_EXPR_DEPTH) {
+    p->ok = 0;
+    return;
+  }
+  tcl_expr_binary(p, 1);
+  if (p->ok && tcl_expr_char(p, '?')) {
+    tcl_expr_emit(p, EX_JUMPZ);
+    int other = tcl_expr_emit(p, 0);
+    tcl_expr_stack(p, -1);
+    tcl_expr_parse(p);
+    tcl_expr_emit(p, EX_JUMP);
+    int end = tcl_expr_emit(p, 0);
+    p->expr->ops[other] = p->expr->nops;
+    tcl_expr_stack(p, -1);
+    p->ok = p->ok && tcl_expr_char(p, ':');
+    tcl_expr_parse(p);
+    p->expr->ops[end] = p->expr->nops;
+  }
+  p->nesting--;
+}
+
+static void tcl_expr_release(struct tcl_expr *expr) {
+  if (--expr->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < expr->nnames; i++) {
+    tcl_free(expr->names[i]);
+    tcl_atom_release(expr->atoms[i]);
+  }
+  for (int i = 0; i < expr->nscripts; i++) {
+    tcl_script_release(expr->scripts[i]);
+  }
+  free(expr->ops);
+  free(expr->names);
+  free(expr->atoms);
+  free(expr->scripts);
+  tcl_free(expr->src);
+  free(expr);
+}
+
+/* Returns NULL if the expression can't be parsed */
+static struct tcl_expr *tcl_expr_compile(struct tcl_proc *proc, const char *s,
+                                         size_t len) {
+  struct tcl_expr_parser p = {s, s + len, NULL, proc, 0, 0, 1};
+  p.expr = calloc(1, sizeof(struct tcl_expr));
+  p.expr->refs = 1;
+  tcl_expr_parse(&p);
+  tcl_expr_space(&p);
+  p.expr->atoms = calloc(p.expr->nnames, sizeof(struct tcl_atom *));
+  if (!p.ok || p.s != p.end) {
+    tcl_expr_release(p.expr);
+    return NULL;
+  }
+  return p.expr;
+}
+
+/* Arithmetic wraps around instead of overflowing */
+static int tcl_expr_binop(int op, int a, int b, int *r) {
+  unsigned int x = (unsigned int)a;
+  unsigned int y = (unsigned int)b;
+  switch (op) {
+  case EX_MUL:
+    return (int)(x * y);
+  case EX_DIV:
+  case EX_MOD:
+    if (b == 0) {
+      *r = FERROR;
+      return 0;
+    } else if (b == -1) {
+      return (op == EX_DIV ? (int)(0u - x) : 0);
+    }
+    return (op == EX_DIV ? a / b : a % b);
+  case EX_ADD:
+    return (int)(x + y);
+  case EX_SUB:
+    return (int)(x - y);
+  case EX_SHL:
+    return (int)(x << (y % (sizeof(int) * 8)));
+  case EX_SHR:
+    return a >> (y % (sizeof(int) * 8));
+  case EX_LT:
+    return a < b;
+  case EX_GT:
+    return a > b;
+  case EX_LE:
+    return a <= b;
+  case EX_GE:
+    return a >= b;
+  case EX_EQ:
+    return a == b;
+  case EX_NE:
+    return a != b;
+  case EX_BAND:
+    return a & b;
+  case EX_BXOR:
+    return a ^ b;
+  default:
+    return a | b;
+  }
+}
+
+/* Sets the result to the value of the expression. Flow codes of the nested
+ * scripts are ignored, errors (including division by zero) fail it */
+static int tcl_expr_eval(struct tcl *tcl, struct tcl_expr *expr) {
+  int buf[TCL_STACK_INLINE];
+  int *stack = buf;
+  const int *ops = expr->ops;
+  int sp = 0;
+  int pc = 0;
+  int r = FNORMAL;
+  if (expr->maxstack > TCL_STACK_INLINE) {
+    stack = malloc(expr->maxstack * sizeof(int));
+  }
+  while (pc < expr->nops && r == FNORMAL) {
+    switch (ops[pc]) {
+    case EX_NUM:
+      stack[sp++] = ops[pc + 1];
+      pc = pc + 2;
+      break;
+    case EX_VAR: {
+      int n = ops[pc + 1];
+      int i = tcl_env_find(
+          tcl->env, tcl_atom_bind(tcl, &expr->atoms[n], expr->names[n]));
+      stack[sp++] = (i < 0 ? 0 : tcl_int(tcl->env->vars[i].value));
+      pc = pc + 2;
+      break;
+    }
+    case EX_SLOT:
+      stack[sp++] = tcl_int(tcl->env->vars[ops[pc + 1]].value);
+      pc = pc + 2;
+      break;
+    case EX_CMD:
+      if (tcl_run(tcl, expr->scripts[ops[pc + 1]]) == FERROR) {
+        r = FERROR;
+      }
+      stack[sp++] = tcl_int(tcl->result);
+      pc = pc + 2;
+      break;
+    case EX_NEG:
+      stack[sp - 1] = (int)(0u - (unsigned int)stack[sp - 1]);
+      pc = pc + 1;
+      break;
+    case EX_NOT:
+      stack[sp - 1] = !stack[sp - 1];
+      pc = pc + 1;
+      break;
+    case EX_BNOT:
+      stack[sp - 1] = ~stack[sp - 1];
+      pc = pc + 1;
+      break;
+    case EX_AND:
+      if (stack[sp - 1] == 0) {
+        pc = ops[pc + 1];
+      } else {
+        sp--;
+        pc = pc + 2;
+      }
+      break;
+    case EX_OR:
+      if (stack[sp - 1] != 0) {
+        stack[sp - 1] = 1;
+        pc = ops[pc + 1];
+      } else {
+        sp--;
+        pc = pc + 2;
       }
-      list = tcl_list_append(list, cur);
-      tcl_free(cur);
-      cur = NULL;
       break;
-    case TPART:
-      tcl_subst(tcl, p.from, p.to - p.from);
-      tcl_value_t *part = tcl_dup(tcl->result);
-      cur = tcl_append(cur, part);
+    case EX_BOOL:
+      stack[sp - 1] = (stack[sp - 1] != 0);
+      pc = pc + 1;
       break;
-    case TCMD:
-      if (tcl_list_length(list) == 0) {
-        tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+    case EX_JUMPZ:
+      sp--;
+      pc = (stack[sp] != 0 ? pc + 2 : ops[pc + 1]);
+      break;
+    case EX_JUMP:
+      pc = ops[pc + 1];
+      break;
+    default:
+      sp--;
+      stack[sp - 1] = tcl_expr_binop(ops[pc], stack[sp - 1], stack[sp], &r);
+      pc = pc + 1;
+    }
+  }
+  int n = (r == FNORMAL && sp > 0 ? stack[0] : 0);
+  if (stack != buf) {
+    free(stack);
+  }
+  if (r == FERROR) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  return tcl_result(tcl, FNORMAL, tcl_value_int(tcl->mem, n));
+}
+
+/* Expressions evaluated by the "expr" command are cached by their source, the
+ * same way as the scripts of "if" and "while" */
+static void tcl_expr_flush(struct tcl *tcl) {
+  for (int i = 0; i < TCL_CACHE_BUCKETS; i++) {
+    while (tcl->exprs[i] != NULL) {
+      struct tcl_expr *expr = tcl->exprs[i];
+      tcl->exprs[i] = expr->next;
+      tcl_expr_release(expr);
+    }
+  }
+  tcl->nexprs = 0;
+}
+
+/* Returns NULL if the expression can't be parsed, otherwise release it with
+ * tcl_expr_release() */
+static struct tcl_expr *tcl_expr_get(struct tcl *tcl, tcl_value_t *src) {
+  const char *s = tcl_string(src);
+  size_t len = tcl_length(src);
+  unsigned int h = tcl_hash(s, len);
+  struct tcl_expr **bucket = &tcl->exprs[h % TCL_CACHE_BUCKETS];
+  struct tcl_expr *expr;
+  for (expr = *bucket; expr != NULL; expr = expr->next) {
+    if (expr->hash == h && (size_t)tcl_length(expr->src) == len &&
+        memcmp(tcl_string(expr->src), s, len) == 0) {
+      expr->refs++;
+      return expr;
+    }
+  }
+  expr = tcl_expr_compile(NULL, s, len);
+  if (expr == NULL) {
+    return NULL;
+  }
+  if (tcl->nexprs >= TCL_CACHE_MAX) {
+    tcl_expr_flush(tcl);
+  }
+  expr->hash = h;
+  expr->src = tcl_dup(src);
+  expr->next = *bucket;
+  expr->refs++;
+  *bucket = expr;
+  tcl->nexprs++;
+  return expr;
+}
+
+/* Compiled scripts are translated into bytecode for a small stack machine.
+ * Words are pushed on the stack and commands take their arguments from it.
+ * Each command that may change the flow knows where to jump (exit) if it
+ * returns anything but FNORMAL, -1 means leaving the script. "if", "while",
+ * "break", "continue" and "return" are compiled inline into jumps and "expr"
+ * into an evaluation of the parsed expression, guarded by a check that they
+ * still refer to the built-in commands. Scripts that can't
+ * be compiled (e.g. with syntax errors) are evaluated by tcl_exec() */
+enum {
+  OP_PUSH,   /* const: push a literal */
+  OP_LOAD,   /* slot: push a local variable */
+  OP_LOADN,  /* const: push a variable by its name */
+  OP_LOADS,  /* replace the name on top of the stack with the variable */
+  OP_CONCAT, /* n: join the top n values into one word */
+  OP_INVOKE, /* n, site, exit: call a command with n words from the stack */
+  OP_RESULT, /* push the result of the last command */
+  OP_EMPTY,  /* set the result to an empty string */
+  OP_JUMP,   /* pc */
+  OP_JUMPF,  /* pc: jump if the result is false */
+  OP_GUARD,  /* site, pc: jump if the site is not the built-in command */
+  OP_LOOP,   /* break, continue, exit: dispatch loop flow codes */
+  OP_FLOW,   /* flow, exit: pop the result and leave with the flow code */
+  OP_EXPR    /* expr, exit: evaluate an expression into the result */
+};
+
+struct tcl_site {
+  tcl_value_t *name; /* NULL if the command name is not a literal */
+  int argc;
+  tcl_cmd_argv_fn_t fn; /* Built-in command compiled inline, or NULL */
+  struct tcl_cmd *cmd;  /* Resolved command, valid while gen matches */
+  unsigned int gen;
+};
+
+struct tcl_code {
+  int *ops;
+  int nops;
+  tcl_value_t **consts;
+  struct tcl_atom **atoms; /* Constants used as names, bound on first use */
+  int nconsts;
+  struct tcl_site *sites;
+  int nsites;
+  struct tcl_expr **exprs;
+  int nexprs;
+  int maxstack;
+};
+
+struct tcl_compiler {
+  struct tcl_code *code;
+  struct tcl_proc *proc; /* Procedure whose parameters are in slots, or NULL */
+  int depth; /* Stack depth at the current instruction */
+  int ok;
+};
+
+static int tcl_cmd_expr(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg);
+static int tcl_cmd_if(struct tcl *tcl, int argc, tcl_value_t **argv,
+                      void *arg);
+static int tcl_cmd_while(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg);
+static int tcl_cmd_flow(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg);
+
+static int tcl_emit(struct tcl_compiler *c, int op) {
+  struct tcl_code *code = c->code;
+  code->ops = tcl_array_grow(code->ops, code->nops, sizeof(int));
+  code->ops[code->nops] = op;
+  return code->nops++;
+}
+
+static void tcl_emit_stack(struct tcl_compiler *c, int n) {
+  c->depth += n;
+  if (c->depth > c->code->maxstack) {
+    c->code->maxstack = c->depth;
+  }
+}
+
+static int tcl_emit_const(struct tcl_compiler *c, tcl_value_t *v) {
+  struct tcl_code *code = c->code;
+  code->consts =
+      tcl_array_grow(code->consts, code->nconsts, sizeof(tcl_value_t *));
+  code->consts[code->nconsts] = tcl_dup(v);
+  return code->nconsts++;
+}
+
+static int tcl_emit_site(struct tcl_compiler *c, struct tcl_command *cmd,
+                         tcl_cmd_argv_fn_t fn) {
+  struct tcl_code *code = c->code;
+  struct tcl_word *word = &cmd->words[0];
+  code->sites =
+      tcl_array_grow(code->sites, code->nsites, sizeof(struct tcl_site));
+  struct tcl_site *site = &code->sites[code->nsites];
+  memset(site, 0, sizeof(*site));
+  if (word->nparts == 1 && word->parts[0].type == PLITERAL) {
+    site->name = tcl_dup(word->parts[0].value);
+  }
+  site->argc = cmd->nwords;
+  site->fn = fn;
+  return code->nsites++;
+}
+
+/* Jumps to a label that is not known yet are chained through their operands
+ * and patched once the label is emitted */
+static void tcl_emit_patch(struct tcl_compiler *c, int chain) {
+  while (chain > 0) {
+    int next = c->code->ops[chain];
+    c->code->ops[chain] = c->code->nops;
+    chain = next;
+  }
+}
+
+static void tcl_emit_script(struct tcl_compiler *c, struct tcl_script *script,
+                            int exit);
+
+static void tcl_emit_part(struct tcl_compiler *c, struct tcl_part *part) {
+  switch (part->type) {
+  case PVAR: {
+    if (part->name->type == PLITERAL) {
+      int slot = (c->proc == NULL ? -1
+                                  : tcl_proc_slot(c->proc, part->name->value));
+      if (slot >= 0) {
+        tcl_emit(c, OP_LOAD);
+        tcl_emit(c, slot);
+      } else {
+        tcl_emit(c, OP_LOADN);
+        tcl_emit(c, tcl_emit_const(c, part->name->value));
+      }
+      tcl_emit_stack(c, 1);
+    } else {
+      tcl_emit_part(c, part->name);
+      tcl_emit(c, OP_LOADS);
+    }
+    break;
+  }
+  case PSUBST: {
+    /* Flow codes of a nested script are ignored, the handler just jumps to
+     * the instruction that takes its result */
+    tcl_emit(c, OP_JUMP);
+    int skip = tcl_emit(c, 0);
+    int handler = tcl_emit(c, OP_JUMP);
+    int done = tcl_emit(c, 0);
+    tcl_emit_patch(c, skip);
+    tcl_emit_script(c, part->script, handler);
+    tcl_emit_patch(c, done);
+    tcl_emit(c, OP_RESULT);
+    tcl_emit_stack(c, 1);
+    break;
+  }
+  default:
+    tcl_emit(c, OP_PUSH);
+    tcl_emit(c, tcl_emit_const(c, part->value));
+    tcl_emit_stack(c, 1);
+  }
+}
+
+static void tcl_emit_word(struct tcl_compiler *c, struct tcl_word *word) {
+  for (int j = 0; j < word->nparts; j++) {
+    tcl_emit_part(c, &word->parts[j]);
+  }
+  if (word->nparts == 0) {
+    tcl_emit(c, OP_PUSH);
+    tcl_emit(c, tcl_emit_const(c, NULL));
+    tcl_emit_stack(c, 1);
+  } else if (word->nparts > 1) {
+    tcl_emit(c, OP_CONCAT);
+    tcl_emit(c, word->nparts);
+    tcl_emit_stack(c, 1 - word->nparts);
+  }
+}
+
+static void tcl_emit_invoke(struct tcl_compiler *c, struct tcl_command *cmd,
+                            int site, int exit) {
+  for (int i = 0; i < cmd->nwords; i++) {
+    tcl_emit_word(c, &cmd->words[i]);
+  }
+  tcl_emit(c, OP_INVOKE);
+  tcl_emit(c, cmd->nwords);
+  tcl_emit(c, site);
+  tcl_emit(c, exit);
+  tcl_emit_stack(c, -cmd->nwords);
+}
+
+static void tcl_emit_body(struct tcl_compiler *c, tcl_value_t *body,
+                          int exit) {
+  struct tcl_script *script =
+      tcl_compile(tcl_string(body), tcl_length(body) + 1);
+  tcl_emit_script(c, script, exit);
+  tcl_script_release(script);
+}
+
+/* Compiles "break", "continue" and "return" into a jump to the exit with the
+ * flow code, followed by a regular call taken if the command was redefined */
+static int tcl_emit_flow(struct tcl_compiler *c, struct tcl_command *cmd,
+                         int exit) {
+  struct tcl_word *word = &cmd->words[0];
+  if (word->nparts != 1 || word->parts[0].type != PLITERAL) {
+    return 0;
+  }
+  const char *name = tcl_string(word->parts[0].value);
+  int flow;
+  if (strcmp(name, "break") == 0 && cmd->nwords == 1) {
+    flow = FBREAK;
+  } else if (strcmp(name, "continue") == 0 && cmd->nwords == 1) {
+    flow = FAGAIN;
+  } else if (strcmp(name, "return") == 0 && cmd->nwords <= 2) {
+    flow = FRETURN;
+  } else {
+    return 0;
+  }
+  int site = tcl_emit_site(c, cmd, tcl_cmd_flow);
+  tcl_emit(c, OP_GUARD);
+  tcl_emit(c, site);
+  int guard = tcl_emit(c, 0);
+  /* The result is what the built-in command would leave */
+  if (flow == FRETURN) {
+    if (cmd->nwords == 2) {
+      tcl_emit_word(c, &cmd->words[1]);
+    } else {
+      tcl_emit(c, OP_PUSH);
+      tcl_emit(c, tcl_emit_const(c, NULL));
+      tcl_emit_stack(c, 1);
+    }
+  } else {
+    tcl_emit(c, OP_PUSH);
+    tcl_emit(c, tcl_emit_const(c, word->parts[0].value));
+    tcl_emit_stack(c, 1);
+  }
+  tcl_emit(c, OP_FLOW);
+  tcl_emit(c, flow);
+  tcl_emit(c, exit);
+  tcl_emit_stack(c, -1);
+  tcl_emit_patch(c, guard);
+  tcl_emit_invoke(c, cmd, site, exit);
+  return 1;
+}
+
+/* Compiles "if" or "while" into jumps, followed by a regular call that is
+ * taken if the command has been redefined */
+static int tcl_emit_inline(struct tcl_compiler *c, struct tcl_command *cmd,
+                           int exit) {
+  if (tcl_emit_flow(c, cmd, exit)) {
+    return 1;
+  }
+  for (int i = 0; i < cmd->nwords; i++) {
+    if (cmd->words[i].nparts != 1 ||
+        cmd->words[i].parts[0].type != PLITERAL) {
+      return 0;
+    }
+  }
+  const char *name = tcl_string(cmd->words[0].parts[0].value);
+  int site, guard, done = 0;
+  struct tcl_expr *expr = NULL;
+  if (strcmp(name, "expr") == 0 && cmd->nwords == 2) {
+    tcl_value_t *src = cmd->words[1].parts[0].value;
+    expr = tcl_expr_compile(c->proc, tcl_string(src), tcl_length(src));
+  }
+  if (expr != NULL) {
+    struct tcl_code *code = c->code;
+    code->exprs =
+        tcl_array_grow(code->exprs, code->nexprs, sizeof(struct tcl_expr *));
+    code->exprs[code->nexprs] = expr;
+    site = tcl_emit_site(c, cmd, tcl_cmd_expr);
+    tcl_emit(c, OP_GUARD);
+    tcl_emit(c, site);
+    guard = tcl_emit(c, 0);
+    tcl_emit(c, OP_EXPR);
+    tcl_emit(c, code->nexprs++);
+    tcl_emit(c, exit);
+  } else if (strcmp(name, "if") == 0 && cmd->nwords > 1) {
+    int end = 0;
+    site = tcl_emit_site(c, cmd, tcl_cmd_if);
+    tcl_emit(c, OP_GUARD);
+    tcl_emit(c, site);
+    guard = tcl_emit(c, 0);
+    for (int i = 1; i < cmd->nwords; i = i + 2) {
+      tcl_emit_body(c, cmd->words[i].parts[0].value, exit);
+      if (i + 1 < cmd->nwords) {
+        tcl_emit(c, OP_JUMPF);
+        int next = tcl_emit(c, 0);
+        tcl_emit_body(c, cmd->words[i + 1].parts[0].value, exit);
+        tcl_emit(c, OP_JUMP);
+        end = tcl_emit(c, end);
+        tcl_emit_patch(c, next);
+      }
+    }
+    tcl_emit_patch(c, end);
+  } else if (strcmp(name, "while") == 0 && cmd->nwords == 3) {
+    site = tcl_emit_site(c, cmd, tcl_cmd_while);
+    tcl_emit(c, OP_GUARD);
+    tcl_emit(c, site);
+    guard = tcl_emit(c, 0);
+    tcl_emit(c, OP_JUMP);
+    int skip = tcl_emit(c, 0);
+    int handler = tcl_emit(c, OP_LOOP);
+    int end = tcl_emit(c, 0);
+    int top = tcl_emit(c, 0);
+    tcl_emit(c, exit);
+    tcl_emit_patch(c, skip);
+    c->code->ops[top] = c->code->nops;
+    tcl_emit_body(c, cmd->words[1].parts[0].value, exit);
+    tcl_emit(c, OP_JUMPF);
+    end = tcl_emit(c, end);
+    tcl_emit_body(c, cmd->words[2].parts[0].value, handler);
+    tcl_emit(c, OP_JUMP);
+    tcl_emit(c, c->code->ops[top]);
+    tcl_emit_patch(c, end);
+  } else {
+    return 0;
+  }
+  tcl_emit(c, OP_JUMP);
+  done = tcl_emit(c, done);
+  tcl_emit_patch(c, guard);
+  tcl_emit_invoke(c, cmd, site, exit);
+  tcl_emit_patch(c, done);
+  return 1;
+}
+
+static void tcl_emit_script(struct tcl_compiler *c, struct tcl_script *script,
+                            int exit) {
+  for (int i = 0; i < script->ncmds && c->ok; i++) {
+    struct tcl_command *cmd = &script->cmds[i];
+    if (cmd->token == TERROR) {
+      c->ok = 0;
+    } else if (cmd->nwords == 0) {
+      tcl_emit(c, OP_EMPTY);
+    } else if (!tcl_emit_inline(c, cmd, exit)) {
+      tcl_emit_invoke(c, cmd, tcl_emit_site(c, cmd, NULL), exit);
+    }
+  }
+}
+
+static void tcl_code_free(struct tcl_code *code) {
+  if (code == NULL) {
+    return;
+  }
+  for (int i = 0; i < code->nconsts; i++) {
+    tcl_free(code->consts[i]);
+    tcl_atom_release(code->atoms[i]);
+  }
+  for (int i = 0; i < code->nsites; i++) {
+    tcl_free(code->sites[i].name);
+  }
+  for (int i = 0; i < code->nexprs; i++) {
+    tcl_expr_release(code->exprs[i]);
+  }
+  free(code->ops);
+  free(code->consts);
+  free(code->atoms);
+  free(code->sites);
+  free(code->exprs);
+  free(code);
+}
+
+/* Returns NULL if the script can't be compiled */
+static struct tcl_code *tcl_code_compile(struct tcl_proc *proc,
+                                         struct tcl_script *script) {
+  struct tcl_compiler c;
+  c.code = calloc(1, sizeof(struct tcl_code));
+  c.proc = proc;
+  c.depth = 0;
+  c.ok = 1;
+  tcl_emit_script(&c, script, -1);
+  c.code->atoms = calloc(c.code->nconsts, sizeof(struct tcl_atom *));
+  if (!c.ok) {
+    tcl_code_free(c.code);
+    return NULL;
+  }
+  return c.code;
+}
+
+static struct tcl_cmd *tcl_site_cmd(struct tcl *tcl, struct tcl_site *site,
+                                    tcl_value_t *name) {
+  if (site->name == NULL) {
+    return tcl_lookup(tcl, name, site->argc);
+  }
+  if (site->gen != tcl->cmdgen) {
+    site->cmd = tcl_lookup(tcl, site->name, site->argc);
+    site->gen = tcl->cmdgen;
+  }
+  return site->cmd;
+}
+
+static int tcl_user_proc(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg);
+
+/* Creates the procedure environment and binds the arguments */
+static void tcl_proc_enter(struct tcl *tcl, struct tcl_proc *proc,
+                           struct tcl_env *parent, int argc,
+                           tcl_value_t **argv) {
+  tcl_env_push(tcl, parent);
+  for (int i = 0; i < proc->nparams; i++) {
+    tcl_value_t *v = (i + 1 < argc ? tcl_dup(argv[i + 1]) : NULL);
+    tcl_var_atom(tcl, proc->atoms[i], v);
+  }
+}
+
+/* With tcl_set_stack() a procedure called from compiled code doesn't run in a
+ * nested tcl_vm(). The VM saves where the caller stopped in a frame on the
+ * heap, which also holds the value stack of the procedure, and switches to the
+ * procedure code; when that code ends the frame is popped and the caller goes
+ * on. "return [proc ...]" reuses the frame of the returning procedure, so tail
+ * recursion runs in constant space */
+struct tcl_frame {
+  struct tcl_frame *prev;
+  struct tcl_code *code; /* Caller to resume */
+  tcl_value_t **stack;
+  int sp;
+  int pc;
+  struct tcl_cmd *cmd; /* Procedure running on this frame */
+  size_t size;
+#ifdef TCL_ENABLE_PROFILE
+  struct tcl_profile_call call;
+#endif
+  tcl_value_t *values[]; /* Value stack of the procedure */
+};
+
+/* Bytes charged for a frame, the procedure environment included */
+#define TCL_FRAME_SIZE(f) ((long)((f)->size + sizeof(struct tcl_env)))
+
+/* Enters the procedure on a new frame, or returns NULL if the limits don't
+ * allow the call. A tail call replaces the environment of the procedure on
+ * the given frame, and the new frame resumes the caller of that one */
+static struct tcl_frame *tcl_frame_push(struct tcl *tcl, struct tcl_cmd *cmd,
+                                        int argc, tcl_value_t **argv,
+                                        struct tcl_frame *tail) {
+  struct tcl_proc *proc = (struct tcl_proc *)cmd->arg;
+  size_t size = sizeof(struct tcl_frame) +
+                proc->code->maxstack * sizeof(tcl_value_t *);
+  long used = tcl->stackused - (tail != NULL ? TCL_FRAME_SIZE(tail) : 0);
+  if (--tcl->ticks <= 0 && tcl_tick(tcl) != FNORMAL) {
+    return NULL;
+  }
+  if (used + (long)(size + sizeof(struct tcl_env)) > tcl->stack) {
+    tcl_abort(tcl, TCL_ABORT_DEPTH);
+    return NULL;
+  }
+  struct tcl_frame *f = tcl->mem->alloc(tcl->mem, size);
+  f->cmd = cmd;
+  f->size = size;
+  if (tail != NULL) {
+#ifdef TCL_ENABLE_PROFILE
+    tcl_profile_end(tcl, tail->cmd, &tail->call);
+#endif
+    /* The arguments are on the value stack, the old environment can go */
+    tcl_env_pop(tcl);
+    tcl_proc_enter(tcl, proc, tcl->env, argc, argv);
+    f->prev = tail->prev;
+    f->code = tail->code;
+    f->stack = tail->stack;
+    f->sp = tail->sp;
+    f->pc = tail->pc;
+  } else {
+    tcl_proc_enter(tcl, proc, tcl->env, argc, argv);
+  }
+  tcl->stackused = used + TCL_FRAME_SIZE(f);
+#ifdef TCL_ENABLE_PROFILE
+  tcl_profile_begin(tcl, cmd, &f->call);
+#endif
+  return f;
+}
+
+/* Leaves the procedure, returns the frame of the caller */
+static struct tcl_frame *tcl_frame_pop(struct tcl *tcl, struct tcl_frame *f) {
+  struct tcl_frame *prev = f->prev;
+  tcl_env_pop(tcl);
+#ifdef TCL_ENABLE_PROFILE
+  tcl_profile_end(tcl, f->cmd, &f->call);
+#endif
+  tcl->stackused -= TCL_FRAME_SIZE(f);
+  tcl->mem->free(tcl->mem, f, f->size);
+  return prev;
+}
+
+static int tcl_vm(struct tcl *tcl, struct tcl_code *code) {
+  tcl_value_t *buf[TCL_STACK_INLINE];
+  tcl_value_t **stack = buf;
+  const int *ops = code->ops;
+  int sp = 0;
+  int pc = 0;
+  int r = FNORMAL;
+  struct tcl_frame *frame = NULL; /* NULL while running the code given */
+  /* Heap frames don't nest on the C stack, but the VM itself does */
+  int nested = (tcl->stack > 0);
+  if (nested && tcl->depth >= tcl->maxdepth) {
+    tcl_abort(tcl, TCL_ABORT_DEPTH);
+    return FERROR;
+  }
+  tcl->depth += nested;
+  if (code->maxstack > TCL_STACK_INLINE) {
+    stack = malloc(code->maxstack * sizeof(tcl_value_t *));
+  }
+  for (;;) {
+    if (pc >= code->nops) {
+      if (frame == NULL) {
+        break;
+      }
+      /* The procedure is done, go on after the call like tcl_user_proc() */
+      while (sp > 0) {
+        tcl_free(stack[--sp]);
+      }
+      code = frame->code;
+      ops = code->ops;
+      stack = frame->stack;
+      sp = frame->sp;
+      pc = frame->pc;
+      frame = tcl_frame_pop(tcl, frame);
+      r = (tcl->aborted ? FERROR : FNORMAL);
+      if (r == FNORMAL) {
+        pc = pc + 4;
       } else {
-        tcl_value_t *cmdname = tcl_list_at(list, 0);
-        struct tcl_cmd *cmd = NULL;
-        int r = FERROR;
-        for (cmd = tcl->cmds; cmd != NULL; cmd = cmd->next) {
-          if (strcmp(tcl_string(cmdname), tcl_string(cmd->name)) == 0) {
-            if (cmd->arity == 0 || cmd->arity == tcl_list_length(list)) {
-              r = cmd->fn(tcl, list, cmd->arg);
-              break;
-            }
+        pc = (ops[pc + 3] < 0 ? code->nops : ops[pc + 3]);
+      }
+      continue;
+    }
+    switch (ops[pc]) {
+    case OP_PUSH:
+      stack[sp++] = tcl_dup(code->consts[ops[pc + 1]]);
+      pc = pc + 2;
+      break;
+    case OP_LOAD:
+      stack[sp++] = tcl_dup(tcl->env->vars[ops[pc + 1]].value);
+      pc = pc + 2;
+      break;
+    case OP_LOADN: {
+      int n = ops[pc + 1];
+      int i = tcl_env_find(
+          tcl->env, tcl_atom_bind(tcl, &code->atoms[n], code->consts[n]));
+      stack[sp++] =
+          (i < 0 ? tcl_empty(tcl) : tcl_dup(tcl->env->vars[i].value));
+      pc = pc + 2;
+      break;
+    }
+    case OP_LOADS: {
+      tcl_value_t *name = stack[sp - 1];
+      const char *s = tcl_string(name);
+      size_t len = tcl_length(name);
+      struct tcl_atom *atom =
+          tcl_atom_lookup(&tcl->atoms, s, len, tcl_hash(s, len), 0);
+      int i = (atom == NULL ? -1 : tcl_env_find(tcl->env, atom));
+      stack[sp - 1] =
+          (i < 0 ? tcl_empty(tcl) : tcl_dup(tcl->env->vars[i].value));
+      tcl_free(name);
+      pc = pc + 1;
+      break;
+    }
+    case OP_CONCAT: {
+      int n = ops[pc + 1];
+      tcl_value_t *cur = stack[sp - n];
+      for (int i = sp - n + 1; i < sp; i++) {
+        cur = tcl_append_string(cur, tcl_string(stack[i]),
+                                tcl_length(stack[i]));
+        tcl_free(stack[i]);
+      }
+      sp = sp - n + 1;
+      stack[sp - 1] = cur;
+      pc = pc + 2;
+      break;
+    }
+    case OP_INVOKE: {
+      int n = ops[pc + 1];
+      tcl_value_t **argv = &stack[sp - n];
+      struct tcl_cmd *cmd = tcl_site_cmd(tcl, &code->sites[ops[pc + 2]],
+                                         argv[0]);
+      /* Commands that don't set the result leave the last word there */
+      tcl_result(tcl, FNORMAL, tcl_dup(argv[n - 1]));
+      if (tcl->stack > 0 && cmd != NULL && cmd->argv_fn == tcl_user_proc &&
+          ((struct tcl_proc *)cmd->arg)->code != NULL) {
+        /* The result of a tail call is returned as it is */
+        int tail = (frame != NULL && pc + 7 < code->nops &&
+                    ops[pc + 4] == OP_RESULT && ops[pc + 5] == OP_FLOW &&
+                    ops[pc + 6] == FRETURN && ops[pc + 7] < 0);
+        struct tcl_frame *f =
+            tcl_frame_push(tcl, cmd, n, argv, (tail ? frame : NULL));
+        if (f != NULL) {
+          while (sp > 0 && (tail || n-- > 0)) {
+            tcl_free(stack[--sp]);
           }
+          if (tail) {
+            tcl->mem->free(tcl->mem, frame, frame->size);
+          } else {
+            f->prev = frame;
+            f->code = code;
+            f->stack = stack;
+            f->sp = sp;
+            f->pc = pc;
+          }
+          frame = f;
+          code = ((struct tcl_proc *)cmd->arg)->code;
+          ops = code->ops;
+          stack = f->values;
+          sp = 0;
+          pc = 0;
+          break;
         }
-        tcl_free(cmdname);
-        if (cmd == NULL || r != FNORMAL) {
-          tcl_list_free(list);
-          return r;
-        }
+        r = FERROR;
+      } else {
+        r = (cmd == NULL ? FERROR : tcl_call(tcl, cmd, n, argv));
+      }
+      while (n-- > 0) {
+        tcl_free(stack[--sp]);
+      }
+      if (r == FNORMAL) {
+        pc = pc + 4;
+      } else {
+        pc = (ops[pc + 3] < 0 ? code->nops : ops[pc + 3]);
+      }
+      break;
+    }
+    case OP_RESULT:
+      stack[sp++] = tcl_dup(tcl->result);
+      r = FNORMAL;
+      pc = pc + 1;
+      break;
+    case OP_EMPTY:
+      tcl_result(tcl, FNORMAL, tcl_empty(tcl));
+      pc = pc + 1;
+      break;
+    case OP_JUMP:
+      pc = ops[pc + 1];
+      break;
+    case OP_JUMPF:
+      pc = (tcl_int(tcl->result) ? pc + 2 : ops[pc + 1]);
+      break;
+    case OP_GUARD: {
+      struct tcl_site *site = &code->sites[ops[pc + 1]];
+      struct tcl_cmd *cmd = tcl_site_cmd(tcl, site, NULL);
+      pc = (cmd != NULL && cmd->argv_fn == site->fn ? pc + 3 : ops[pc + 2]);
+      break;
+    }
+    case OP_FLOW:
+      tcl_result(tcl, FNORMAL, stack[--sp]);
+      r = ops[pc + 1];
+      pc = (ops[pc + 2] < 0 ? code->nops : ops[pc + 2]);
+      break;
+    case OP_EXPR:
+      /* Counts as a command call, so that limits apply to loops of it */
+      if (--tcl->ticks <= 0 && tcl_tick(tcl) != FNORMAL) {
+        r = tcl_result(tcl, FERROR, tcl_empty(tcl));
+      } else {
+        r = tcl_expr_eval(tcl, code->exprs[ops[pc + 1]]);
+      }
+      if (r == FNORMAL) {
+        pc = pc + 3;
+      } else {
+        pc = (ops[pc + 2] < 0 ? code->nops : ops[pc + 2]);
+      }
+      break;
+    case OP_LOOP:
+      if (r == FBREAK) {
+        r = FNORMAL;
+        pc = ops[pc + 1];
+      } else if (r == FAGAIN) {
+        r = FNORMAL;
+        pc = ops[pc + 2];
+      } else {
+        pc = (ops[pc + 3] < 0 ? code->nops : ops[pc + 3]);
       }
-      tcl_list_free(list);
-      list = tcl_list_alloc();
       break;
     }
   }
-  tcl_list_free(list);
-  return FNORMAL;
+  while (sp > 0) {
+    tcl_free(stack[--sp]);
+  }
+  if (stack != buf) {
+    free(stack);
+  }
+  tcl->depth -= nested;
+  return r;
+}
+
+/* Evaluates a compiled script, translating it into bytecode the first time */
+static int tcl_run(struct tcl *tcl, struct tcl_script *script) {
+  if (script->code == NULL && !script->nocode) {
+    script->code = tcl_code_compile(NULL, script);
+    script->nocode = (script->code == NULL);
+  }
+  if (script->code == NULL) {
+    return tcl_exec(tcl, script);
+  }
+  return tcl_vm(tcl, script->code);
+}
+
+/* Scripts still being evaluated are kept alive by their own references */
+static void tcl_cache_flush(struct tcl *tcl) {
+  for (int i = 0; i < TCL_CACHE_BUCKETS; i++) {
+    while (tcl->cache[i] != NULL) {
+      struct tcl_script *script = tcl->cache[i];
+      tcl->cache[i] = script->next;
+      tcl_script_release(script);
+    }
+  }
+  tcl->ncache = 0;
+}
+
+/* Returns a compiled script for the given code, reusing the cached one if the
+ * same code has been compiled before. Release it with tcl_script_release() */
+static struct tcl_script *tcl_script_get(struct tcl *tcl, tcl_value_t *code) {
+  const char *s = tcl_string(code);
+  size_t len = tcl_length(code);
+  unsigned int h = tcl_hash(s, len);
+  struct tcl_script **bucket = &tcl->cache[h % TCL_CACHE_BUCKETS];
+  struct tcl_script *script;
+  for (script = *bucket; script != NULL; script = script->next) {
+    if (script->hash == h && (size_t)tcl_length(script->src) == len &&
+        memcmp(tcl_string(script->src), s, len) == 0) {
+      script->refs++;
+      return script;
+    }
+  }
+  if (tcl->ncache >= TCL_CACHE_MAX) {
+    tcl_cache_flush(tcl);
+  }
+  script = tcl_compile(s, len + 1);
+  script->hash = h;
+  script->src = tcl_dup(code);
+  script->next = *bucket;
+  script->refs++;
+  *bucket = script;
+  tcl->ncache++;
+  return script;
+}
+
+int tcl_eval(struct tcl *tcl, const char *s, size_t len) {
+  DBG("eval(%.*s)->\n", (int)len, s);
+  /* A script evaluated once is not worth translating into bytecode, loop
+   * bodies are translated by the commands that run them */
+  struct tcl_script *script = tcl_compile(s, len);
+  int r = tcl_exec(tcl, script);
+  tcl_script_release(script);
+  return r;
+}
+
+#ifndef TCL_DISABLE_SOURCE
+/* Evaluates a file mapped into memory, without copying it. The lexer never
+ * reads past the given length, only the last command is copied if it lacks a
+ * separator and needs to be NUL-terminated */
+int tcl_eval_file(struct tcl *tcl, const char *path) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  size_t len = st.st_size;
+  if (len == 0) {
+    close(fd);
+    return tcl_result(tcl, FNORMAL, tcl_empty(tcl));
+  }
+  char *s = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (s == MAP_FAILED) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  /* Commands are compiled and evaluated one by one, so that a large script
+   * is never compiled as a whole */
+  struct tcl_reader reader = {0, 0, 0, 0};
+  size_t end = 0;
+  size_t n;
+  int r = FNORMAL;
+  while (r == FNORMAL &&
+         (n = tcl_reader_feed(&reader, s + end, len - end)) > 0) {
+    r = tcl_eval(tcl, s + end, n);
+    end = end + n;
+  }
+  if (r == FNORMAL && end < len) {
+    tcl_value_t *tail = tcl_value_new(tcl->mem, s + end, len - end);
+    r = tcl_eval(tcl, tcl_string(tail), tcl_length(tail) + 1);
+    tcl_free(tail);
+  }
+  munmap(s, len);
+  return r;
 }
+#endif
 
 /* --------------------------------- */
 /* --------------------------------- */
 /* --------------------------------- */
 /* --------------------------------- */
 /* --------------------------------- */
-void tcl_register(struct tcl *tcl, const char *name, tcl_cmd_fn_t fn, int arity,
-                  void *arg) {
+static struct tcl_cmd *tcl_cmd_add(struct tcl *tcl, const char *name,
+                                   int arity, void *arg) {
   struct tcl_cmd *cmd = malloc(sizeof(struct tcl_cmd));
-  cmd->name = tcl_alloc(name, strlen(name));
-  cmd->fn = fn;
+  cmd->name = tcl_atom_lookup(&tcl->atoms, name, strlen(name),
+                              tcl_hash(name, strlen(name)), 1);
+  cmd->fn = NULL;
+  cmd->argv_fn = NULL;
   cmd->arg = arg;
   cmd->arity = arity;
-  cmd->next = tcl->cmds;
-  tcl->cmds = cmd;
+#ifdef TCL_ENABLE_PROFILE
+  memset(&cmd->profile, 0, sizeof(cmd->profile));
+#endif
+  if ((tcl->ncmds + 1) * 2 > tcl->cmdcap) {
+    /* Keep the table at most half full, so that probe sequences stay short */
+    int cap = (tcl->cmdcap == 0 ? TCL_CMDS_MIN : tcl->cmdcap * 2);
+    struct tcl_cmd **cmds = calloc(cap, sizeof(struct tcl_cmd *));
+    for (int i = 0; i < tcl->cmdcap; i++) {
+      if (tcl->cmds[i] != NULL) {
+        struct tcl_cmd *c = tcl->cmds[i];
+        *tcl_cmd_slot(cmds, cap, c->name) = c;
+      }
+    }
+    free(tcl->cmds);
+    tcl->cmds = cmds;
+    tcl->cmdcap = cap;
+  }
+  struct tcl_cmd **slot = tcl_cmd_slot(tcl->cmds, tcl->cmdcap, cmd->name);
+  if (*slot == NULL) {
+    tcl->ncmds++;
+  }
+  cmd->next = *slot;
+  *slot = cmd;
+  tcl->cmdgen++;
+  return cmd;
+}
+
+void tcl_register(struct tcl *tcl, const char *name, tcl_cmd_fn_t fn, int arity,
+                  void *arg) {
+  tcl_cmd_add(tcl, name, arity, arg)->fn = fn;
+}
+
+void tcl_register_argv(struct tcl *tcl, const char *name, tcl_cmd_argv_fn_t fn,
+                       int arity, void *arg) {
+  tcl_cmd_add(tcl, name, arity, arg)->argv_fn = fn;
 }
 
-static int tcl_cmd_set(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_set(struct tcl *tcl, int argc, tcl_value_t **argv,
+                       void *arg) {
   (void)arg;
-  tcl_value_t *var = tcl_list_at(args, 1);
-  tcl_value_t *val = tcl_list_at(args, 2);
-  int r = tcl_result(tcl, FNORMAL, tcl_dup(tcl_var(tcl, var, val)));
-  tcl_free(var);
-  return r;
+  if (argc < 2) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  tcl_value_t *val = (argc > 2 ? tcl_dup(argv[2]) : NULL);
+  return tcl_result(tcl, FNORMAL, tcl_dup(tcl_var_value(tcl, argv[1], val)));
 }
 
-static int tcl_cmd_subst(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_subst(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
   (void)arg;
-  tcl_value_t *s = tcl_list_at(args, 1);
-  int r = tcl_subst(tcl, tcl_string(s), tcl_length(s));
-  tcl_free(s);
-  return r;
+  (void)argc;
+  return tcl_subst(tcl, tcl_string(argv[1]), tcl_length(argv[1]));
 }
 
 #ifndef TCL_DISABLE_PUTS
-static int tcl_cmd_puts(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_puts(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
   (void)arg;
-  tcl_value_t *text = tcl_list_at(args, 1);
-  puts(tcl_string(text));
-  putchar('\n');
-  return tcl_result(tcl, FNORMAL, text);
-}
-#endif
-
-static int tcl_user_proc(struct tcl *tcl, tcl_value_t *args, void *arg) {
-  tcl_value_t *code = (tcl_value_t *)arg;
-  tcl_value_t *params = tcl_list_at(code, 2);
-  tcl_value_t *body = tcl_list_at(code, 3);
-  tcl->env = tcl_env_alloc(tcl->env);
-  for (int i = 0; i < tcl_list_length(params); i++) {
-    tcl_value_t *param = tcl_list_at(params, i);
-    tcl_value_t *v = tcl_list_at(args, i + 1);
-    tcl_var(tcl, param, v);
-    tcl_free(param);
-  }
-  tcl_eval(tcl, tcl_string(body), tcl_length(body) + 1);
-  tcl->env = tcl_env_free(tcl->env);
-  tcl_free(params);
-  tcl_free(body);
-  return FNORMAL;
+  (void)argc;
+  /* The stream stays locked, so lines printed by concurrent interpreters don't
+   * mix. Values may hold NULs, so the whole length is written */
+  flockfile(stdout);
+  fwrite(tcl_string(argv[1]), 1, tcl_length(argv[1]), stdout);
+  putc('\n', stdout);
+  funlockfile(stdout);
+  return tcl_result(tcl, FNORMAL, tcl_dup(argv[1]));
+}
+#endif
+
+/* Parameters are the first variables created in the procedure environment,
+ * so their slots are known as soon as the procedure is defined */
+static int tcl_proc_slot(struct tcl_proc *proc, tcl_value_t *name) {
+  int slot = 0;
+  for (int i = 0; i < proc->nparams; i++) {
+    int j = 0;
+    while (j < i && strcmp(tcl_string(proc->params[j]),
+                           tcl_string(proc->params[i])) != 0) {
+      j++;
+    }
+    if (j == i) {
+      if (strcmp(tcl_string(proc->params[i]), tcl_string(name)) == 0) {
+        return slot;
+      }
+      slot++;
+    }
+  }
+  return -1;
+}
+
+static void tcl_proc_resolve(struct tcl_proc *proc, struct tcl_script *script);
+
+static void tcl_proc_resolve_part(struct tcl_proc *proc,
+                                  struct tcl_part *part) {
+  if (part->type == PVAR) {
+    if (part->name->type == PLITERAL) {
+      part->slot = tcl_proc_slot(proc, part->name->value);
+    }
+    tcl_proc_resolve_part(proc, part->name);
+  } else if (part->type == PSUBST) {
+    tcl_proc_resolve(proc, part->script);
+  }
+}
+
+static void tcl_proc_resolve(struct tcl_proc *proc, struct tcl_script *script) {
+  for (int i = 0; i < script->ncmds; i++) {
+    struct tcl_command *cmd = &script->cmds[i];
+    for (int j = 0; j < cmd->nwords; j++) {
+      for (int k = 0; k < cmd->words[j].nparts; k++) {
+        tcl_proc_resolve_part(proc, &cmd->words[j].parts[k]);
+      }
+    }
+  }
+}
+
+static int tcl_user_proc(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  struct tcl_proc *proc = (struct tcl_proc *)arg;
+  tcl_proc_enter(tcl, proc, tcl->env, argc, argv);
+  if (proc->code != NULL) {
+    tcl_vm(tcl, proc->code);
+  } else {
+    tcl_exec(tcl, proc->body);
+  }
+  tcl_env_pop(tcl);
+  /* Errors stay inside the procedure, unless the whole script is aborted */
+  return (tcl->aborted ? FERROR : FNORMAL);
 }
 
-static int tcl_cmd_proc(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static void tcl_proc_free(struct tcl_proc *proc) {
+  for (int i = 0; i < proc->nparams; i++) {
+    tcl_free(proc->params[i]);
+    tcl_atom_release(proc->atoms[i]);
+  }
+  free(proc->params);
+  free(proc->atoms);
+  if (proc->body != NULL) {
+    tcl_script_release(proc->body);
+  }
+  tcl_code_free(proc->code);
+  free(proc);
+}
+
+#ifndef TCL_DISABLE_SOURCE
+static int tcl_cmd_source(struct tcl *tcl, int argc, tcl_value_t **argv,
+                          void *arg) {
+  (void)arg;
+  (void)argc;
+  int r = tcl_eval_file(tcl, tcl_string(argv[1]));
+  /* "return" stops the sourced script, not the caller */
+  return (r == FRETURN ? FNORMAL : r);
+}
+#endif
+
+static int tcl_cmd_proc(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
   (void)arg;
-  tcl_value_t *name = tcl_list_at(args, 1);
-  tcl_register(tcl, tcl_string(name), tcl_user_proc, 0, tcl_dup(args));
-  tcl_free(name);
-  return tcl_result(tcl, FNORMAL, tcl_alloc("", 0));
+  (void)argc;
+  struct tcl_proc *proc = malloc(sizeof(struct tcl_proc));
+  tcl_value_t *params = argv[2];
+  tcl_value_t *body = argv[3];
+  proc->nparams = tcl_list_length(params);
+  proc->params = malloc(proc->nparams * sizeof(tcl_value_t *));
+  proc->atoms = malloc(proc->nparams * sizeof(struct tcl_atom *));
+  for (int i = 0; i < proc->nparams; i++) {
+    proc->params[i] = tcl_list_at(params, i);
+    proc->atoms[i] = tcl_atom(&tcl->atoms, proc->params[i]);
+  }
+  /* Procedure bodies are not shared through the cache, their variable
+   * references are bound to the slots of this particular procedure */
+  proc->body = tcl_compile(tcl_string(body), tcl_length(body) + 1);
+  tcl_proc_resolve(proc, proc->body);
+  proc->code = tcl_code_compile(proc, proc->body);
+  if (proc->code != NULL) {
+    tcl_script_release(proc->body);
+    proc->body = NULL;
+  }
+  tcl_register_argv(tcl, tcl_string(argv[1]), tcl_user_proc, 0, proc);
+  return tcl_result(tcl, FNORMAL, tcl_empty(tcl));
 }
 
-static int tcl_cmd_if(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_if(struct tcl *tcl, int argc, tcl_value_t **argv,
+                      void *arg) {
   (void)arg;
   int i = 1;
-  int n = tcl_list_length(args);
   int r = FNORMAL;
-  while (i < n) {
-    tcl_value_t *cond = tcl_list_at(args, i);
-    tcl_value_t *branch = NULL;
-    if (i + 1 < n) {
-      branch = tcl_list_at(args, i + 1);
-    }
-    r = tcl_eval(tcl, tcl_string(cond), tcl_length(cond) + 1);
-    tcl_free(cond);
+  while (i < argc) {
+    struct tcl_script *script = tcl_script_get(tcl, argv[i]);
+    r = tcl_run(tcl, script);
+    tcl_script_release(script);
     if (r != FNORMAL) {
-      tcl_free(branch);
       break;
     }
     if (tcl_int(tcl->result)) {
-      r = tcl_eval(tcl, tcl_string(branch), tcl_length(branch) + 1);
-      tcl_free(branch);
+      if (i + 1 < argc) {
+        script = tcl_script_get(tcl, argv[i + 1]);
+        r = tcl_run(tcl, script);
+        tcl_script_release(script);
+      }
       break;
     }
     i = i + 2;
-    tcl_free(branch);
   }
   return r;
 }
 
-static int tcl_cmd_flow(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_flow(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
   (void)arg;
   int r = FERROR;
-  tcl_value_t *flowval = tcl_list_at(args, 0);
-  const char *flow = tcl_string(flowval);
+  const char *flow = tcl_string(argv[0]);
   if (strcmp(flow, "break") == 0) {
     r = FBREAK;
   } else if (strcmp(flow, "continue") == 0) {
     r = FAGAIN;
   } else if (strcmp(flow, "return") == 0) {
-    r = tcl_result(tcl, FRETURN, tcl_list_at(args, 1));
+    tcl_value_t *v = (argc > 1 ? tcl_dup(argv[1]) : tcl_empty(tcl));
+    r = tcl_result(tcl, FRETURN, v);
+  }
+  return r;
+}
+
+/* Multiple arguments are joined with spaces, as in Tcl */
+static int tcl_cmd_expr(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
+  (void)arg;
+  if (argc < 2) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
   }
-  tcl_free(flowval);
+  tcl_value_t *src = tcl_dup(argv[1]);
+  for (int i = 2; i < argc; i++) {
+    src = tcl_append_string(src, " ", 1);
+    src = tcl_append_string(src, tcl_string(argv[i]), tcl_length(argv[i]));
+  }
+  struct tcl_expr *expr = tcl_expr_get(tcl, src);
+  tcl_free(src);
+  if (expr == NULL) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  int r = tcl_expr_eval(tcl, expr);
+  tcl_expr_release(expr);
   return r;
 }
 
-static int tcl_cmd_while(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_while(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
   (void)arg;
-  tcl_value_t *cond = tcl_list_at(args, 1);
-  tcl_value_t *loop = tcl_list_at(args, 2);
+  (void)argc;
+  struct tcl_script *cond = tcl_script_get(tcl, argv[1]);
+  struct tcl_script *loop = tcl_script_get(tcl, argv[2]);
   int r;
   for (;;) {
-    r = tcl_eval(tcl, tcl_string(cond), tcl_length(cond) + 1);
+    r = tcl_run(tcl, cond);
     if (r != FNORMAL) {
-      tcl_free(cond);
-      tcl_free(loop);
-      return r;
+      break;
     }
     if (!tcl_int(tcl->result)) {
-      tcl_free(cond);
-      tcl_free(loop);
-      return FNORMAL;
-    }
-    int r = tcl_eval(tcl, tcl_string(loop), tcl_length(loop) + 1);
-    switch (r) {
-    case FBREAK:
-      tcl_free(cond);
-      tcl_free(loop);
-      return FNORMAL;
-    case FRETURN:
-      tcl_free(cond);
-      tcl_free(loop);
-      return FRETURN;
-    case FAGAIN:
-      continue;
-    case FERROR:
-      tcl_free(cond);
-      tcl_free(loop);
-      return FERROR;
+      break;
+    }
+    r = tcl_run(tcl, loop);
+    if (r == FBREAK) {
+      r = FNORMAL;
+      break;
+    } else if (r == FRETURN || r == FERROR) {
+      break;
+    }
+  }
+  tcl_script_release(cond);
+  tcl_script_release(loop);
+  return r;
+}
+
+/* Subcommands: create, get, exists, size, set, unset and for. "set" and
+ * "unset" take the dict out of the variable while updating it, so a dict that
+ * is not shared with other values is modified in place */
+static int tcl_cmd_dict(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
+  (void)arg;
+  const char *op = (argc > 1 ? tcl_string(argv[1]) : "");
+  if (strcmp(op, "create") == 0 && argc % 2 == 0) {
+    tcl_value_t *v = tcl_value_alloc(tcl->mem, TCL_VALUE_LIST);
+    for (int i = 2; i < argc; i++) {
+      tcl_list_push(v, tcl_dup(argv[i]));
+    }
+    tcl_dict_index(v);
+    return tcl_result(tcl, FNORMAL, tcl_dict_own(v));
+  } else if (strcmp(op, "get") == 0 && argc > 2) {
+    tcl_value_t *v = tcl_dict_path(argv[2], argv + 3, argc - 3);
+    if (v != NULL && argc > 3) {
+      return tcl_result(tcl, FNORMAL, tcl_dup(v));
+    } else if (v != NULL && tcl_dict_parse(v) == 0) {
+      /* The whole dict, without the keys hidden by later ones */
+      return tcl_result(tcl, FNORMAL, tcl_dict_own(tcl_dup(v)));
+    }
+  } else if (strcmp(op, "exists") == 0 && argc > 3) {
+    tcl_value_t *v = tcl_dict_path(argv[2], argv + 3, argc - 3);
+    return tcl_result(tcl, FNORMAL, tcl_value_int(tcl->mem, v != NULL));
+  } else if (strcmp(op, "size") == 0 && argc == 3) {
+    if (tcl_dict_parse(argv[2]) == 0) {
+      int n = argv[2]->index[1];
+      return tcl_result(tcl, FNORMAL, tcl_value_int(tcl->mem, n));
+    }
+  } else if ((strcmp(op, "set") == 0 && argc > 4) ||
+             (strcmp(op, "unset") == 0 && argc > 3)) {
+    int n = (op[0] == 's' ? argc - 4 : argc - 3);
+    tcl_value_t *val = (op[0] == 's' ? argv[argc - 1] : NULL);
+    tcl_value_t *v = tcl_var_value(tcl, argv[2], NULL);
+    for (int i = 0; i < n && v != NULL; i++) {
+      if (tcl_dict_parse(v) < 0) {
+        return tcl_result(tcl, FERROR, tcl_empty(tcl));
+      }
+      v = (i + 1 < n ? tcl_dict_get(v, argv[3 + i]) : NULL);
+    }
+    v = tcl_dup(tcl_var_value(tcl, argv[2], NULL));
+    tcl_var_value(tcl, argv[2], tcl_empty(tcl));
+    v = tcl_dict_put(v, argv + 3, n, val);
+    return tcl_result(tcl, FNORMAL, tcl_dup(tcl_var_value(tcl, argv[2], v)));
+  } else if (strcmp(op, "for") == 0 && argc == 5 &&
+             tcl_list_length(argv[2]) == 2 && tcl_dict_parse(argv[3]) == 0) {
+    /* The loop keeps a reference, changes made by the body make a copy */
+    tcl_value_t *v = tcl_dup(argv[3]);
+    if (v->index[1] * 2 != v->nitems) {
+      v = tcl_dict_own(v);
+    }
+    struct tcl_atom *key = tcl_atom(&tcl->atoms, argv[2]->items[0]);
+    struct tcl_atom *value = tcl_atom(&tcl->atoms, argv[2]->items[1]);
+    struct tcl_script *body = tcl_script_get(tcl, argv[4]);
+    int r = FNORMAL;
+    for (int i = 0; i < v->nitems; i += 2) {
+      tcl_var_atom(tcl, key, tcl_dup(v->items[i]));
+      tcl_var_atom(tcl, value, tcl_dup(v->items[i + 1]));
+      r = tcl_run(tcl, body);
+      if (r == FBREAK) {
+        r = FNORMAL;
+        break;
+      } else if (r == FRETURN || r == FERROR) {
+        break;
+      }
+      r = FNORMAL;
+    }
+    tcl_script_release(body);
+    tcl_atom_release(key);
+    tcl_atom_release(value);
+    tcl_free(v);
+    return (r == FNORMAL ? tcl_result(tcl, r, tcl_empty(tcl)) : r);
+  }
+  return tcl_result(tcl, FERROR, tcl_empty(tcl));
+}
+
+static int tcl_cmd_llength(struct tcl *tcl, int argc, tcl_value_t **argv,
+                           void *arg) {
+  (void)arg;
+  (void)argc;
+  int n = tcl_list_length(argv[1]);
+  return tcl_result(tcl, FNORMAL, tcl_value_int(tcl->mem, n));
+}
+
+/* Parses a list index, which is a number, "end" or "end-N" */
+static int tcl_list_index(tcl_value_t *index, int n) {
+  const char *s = tcl_string(index);
+  if (strncmp(s, "end", 3) == 0) {
+    return n - 1 - (s[3] == '-' ? atoi(s + 4) : 0);
+  }
+  return tcl_int(index);
+}
+
+/* An index out of range gives an empty string, as in Tcl */
+static int tcl_cmd_lindex(struct tcl *tcl, int argc, tcl_value_t **argv,
+                          void *arg) {
+  (void)arg;
+  if (argc == 2) {
+    return tcl_result(tcl, FNORMAL, tcl_dup(argv[1]));
+  } else if (argc != 3) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  int i = tcl_list_index(argv[2], tcl_list_length(argv[1]));
+  tcl_value_t *v = tcl_list_at(argv[1], i);
+  return tcl_result(tcl, FNORMAL, (v == NULL ? tcl_empty(tcl) : v));
+}
+
+static int tcl_cmd_lrange(struct tcl *tcl, int argc, tcl_value_t **argv,
+                          void *arg) {
+  (void)arg;
+  (void)argc;
+  int n = tcl_list_length(argv[1]);
+  int first = tcl_list_index(argv[2], n);
+  int last = tcl_list_index(argv[3], n);
+  tcl_value_t *v = tcl_value_alloc(tcl->mem, TCL_VALUE_LIST);
+  for (int i = (first < 0 ? 0 : first); i <= last && i < n; i++) {
+    tcl_list_push(v, tcl_dup(argv[1]->items[i]));
+  }
+  return tcl_result(tcl, FNORMAL, v);
+}
+
+/* Like "dict set", takes the list out of the variable while appending, so a
+ * list that is not shared grows in place */
+static int tcl_cmd_lappend(struct tcl *tcl, int argc, tcl_value_t **argv,
+                           void *arg) {
+  (void)arg;
+  if (argc < 2) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  tcl_value_t *v = tcl_dup(tcl_var_value(tcl, argv[1], NULL));
+  tcl_var_value(tcl, argv[1], tcl_empty(tcl));
+  for (int i = 2; i < argc; i++) {
+    v = tcl_list_append(v, argv[i]);
+  }
+  return tcl_result(tcl, FNORMAL, tcl_dup(tcl_var_value(tcl, argv[1], v)));
+}
+
+#define TCL_SORT_INTEGER 1
+#define TCL_SORT_DECREASING 2
+
+static int tcl_sort_compare(tcl_value_t *a, tcl_value_t *b, int flags) {
+  int r;
+  if (flags & TCL_SORT_INTEGER) {
+    r = (tcl_int(a) > tcl_int(b)) - (tcl_int(a) < tcl_int(b));
+  } else {
+    int n = (tcl_length(a) < tcl_length(b) ? tcl_length(a) : tcl_length(b));
+    r = memcmp(tcl_string(a), tcl_string(b), n);
+    if (r == 0) {
+      r = (tcl_length(a) > tcl_length(b)) - (tcl_length(a) < tcl_length(b));
+    }
+  }
+  return (flags & TCL_SORT_DECREASING ? -r : r);
+}
+
+/* Bottom-up merge sort. It is stable: when items compare equal, the one from
+ * the left run goes first */
+static void tcl_sort(tcl_value_t **items, int n, int flags) {
+  tcl_value_t **tmp = malloc(n * sizeof(tcl_value_t *));
+  tcl_value_t **from = items;
+  tcl_value_t **to = tmp;
+  for (int width = 1; width < n; width = width * 2) {
+    for (int lo = 0; lo < n; lo += 2 * width) {
+      int mid = (lo + width < n ? lo + width : n);
+      int hi = (lo + 2 * width < n ? lo + 2 * width : n);
+      int i = lo, j = mid, k = lo;
+      while (i < mid && j < hi) {
+        if (tcl_sort_compare(from[j], from[i], flags) < 0) {
+          to[k++] = from[j++];
+        } else {
+          to[k++] = from[i++];
+        }
+      }
+      while (i < mid) {
+        to[k++] = from[i++];
+      }
+      while (j < hi) {
+        to[k++] = from[j++];
+      }
+    }
+    tcl_value_t **swap = from;
+    from = to;
+    to = swap;
+  }
+  if (from != items) {
+    memcpy(items, from, n * sizeof(tcl_value_t *));
+  }
+  free(tmp);
+}
+
+/* Options: -integer compares items as numbers, -decreasing reverses the
+ * order. Items are compared as strings otherwise */
+static int tcl_cmd_lsort(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)arg;
+  int flags = 0;
+  for (int i = 1; i + 1 < argc; i++) {
+    if (strcmp(tcl_string(argv[i]), "-integer") == 0) {
+      flags |= TCL_SORT_INTEGER;
+    } else if (strcmp(tcl_string(argv[i]), "-decreasing") == 0) {
+      flags |= TCL_SORT_DECREASING;
+    } else if (strcmp(tcl_string(argv[i]), "-increasing") != 0) {
+      return tcl_result(tcl, FERROR, tcl_empty(tcl));
+    }
+  }
+  if (argc < 2) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  tcl_value_t *list = argv[argc - 1];
+  tcl_value_t *v = tcl_value_alloc(tcl->mem, TCL_VALUE_LIST);
+  for (int i = 0; i < tcl_list_length(list); i++) {
+    tcl_list_push(v, tcl_dup(list->items[i]));
+  }
+  tcl_sort(v->items, v->nitems, flags);
+  return tcl_result(tcl, FNORMAL, v);
+}
+
+/* foreach takes one variable or a list of them, consuming as many items per
+ * iteration. Variables left without an item at the end get an empty string */
+static int tcl_cmd_foreach(struct tcl *tcl, int argc, tcl_value_t **argv,
+                           void *arg) {
+  (void)arg;
+  (void)argc;
+  tcl_value_t *vars = argv[1];
+  int nvars = tcl_list_length(vars);
+  if (nvars == 0) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  /* The loop keeps a reference, changes made by the body make a copy */
+  tcl_value_t *v = tcl_dup(argv[2]);
+  struct tcl_atom **names = malloc(nvars * sizeof(struct tcl_atom *));
+  for (int j = 0; j < nvars; j++) {
+    names[j] = tcl_atom(&tcl->atoms, vars->items[j]);
+  }
+  struct tcl_script *body = tcl_script_get(tcl, argv[3]);
+  int r = FNORMAL;
+  for (int i = 0; i < tcl_list_length(v); i += nvars) {
+    for (int j = 0; j < nvars; j++) {
+      tcl_value_t *item = (i + j < v->nitems ? tcl_dup(v->items[i + j])
+                                              : tcl_empty(tcl));
+      tcl_var_atom(tcl, names[j], item);
+    }
+    r = tcl_run(tcl, body);
+    if (r == FBREAK) {
+      r = FNORMAL;
+      break;
+    } else if (r == FRETURN || r == FERROR) {
+      break;
     }
+    r = FNORMAL;
   }
+  tcl_script_release(body);
+  for (int j = 0; j < nvars; j++) {
+    tcl_atom_release(names[j]);
+  }
+  free(names);
+  tcl_free(v);
+  return (r == FNORMAL ? tcl_result(tcl, r, tcl_empty(tcl)) : r);
 }
 
 #ifndef TCL_DISABLE_MATH
-static int tcl_cmd_math(struct tcl *tcl, tcl_value_t *args, void *arg) {
+static int tcl_cmd_math(struct tcl *tcl, int argc, tcl_value_t **argv,
+                        void *arg) {
   (void)arg;
-  char buf[64];
-  tcl_value_t *opval = tcl_list_at(args, 0);
-  tcl_value_t *aval = tcl_list_at(args, 1);
-  tcl_value_t *bval = tcl_list_at(args, 2);
-  const char *op = tcl_string(opval);
-  int a = tcl_int(aval);
-  int b = tcl_int(bval);
+  (void)argc;
+  const char *op = tcl_string(argv[0]);
+  int a = tcl_int(argv[1]);
+  int b = tcl_int(argv[2]);
   int c = 0;
   if (op[0] == '+') {
     c = a + b;
@@ -567,117 +3571,738 @@ static int tcl_cmd_math(struct tcl *tcl, tcl_value_t *args, void *arg) {
   } else if (op[0] == '!' && op[1] == '=') {
     c = a != b;
   }
+  return tcl_result(tcl, FNORMAL, tcl_value_int(tcl->mem, c));
+}
+#endif
+
+/* Limits the number of commands the interpreter may call, -1 removes the
+ * limit. When the budget runs out the script fails and tcl->aborted is set to
+ * TCL_ABORT_BUDGET, further scripts fail until the budget is set again */
+void tcl_set_budget(struct tcl *tcl, long commands) {
+  tcl->budget = commands;
+  tcl_ticks_reset(tcl);
+}
+
+/* Limits how deep commands (e.g. recursive procedures) may be nested */
+void tcl_set_depth(struct tcl *tcl, int depth) { tcl->maxdepth = depth; }
+
+/* Runs procedures called from compiled code on frames allocated from the
+ * interpreter allocator instead of the C stack, with at most the given number
+ * of bytes in use. Deeper recursion fails with tcl->aborted set to
+ * TCL_ABORT_DEPTH. 0 nests procedures on the C stack again */
+void tcl_set_stack(struct tcl *tcl, long bytes) { tcl->stack = bytes; }
+
+/* Calls the hook after every given number of commands, e.g. to run other
+ * work or to check a deadline. If the hook returns non-zero the script fails
+ * and tcl->aborted is set to TCL_ABORT_HOOK */
+void tcl_set_hook(struct tcl *tcl, long every,
+                  int (*hook)(struct tcl *tcl, void *arg), void *arg) {
+  tcl->hook = hook;
+  tcl->hookarg = arg;
+  tcl->every = tcl->untilhook = (every > 0 ? every : 1);
+  tcl_ticks_reset(tcl);
+}
+
+static void tcl_limits_init(struct tcl *tcl) {
+  tcl->depth = 0;
+  tcl->maxdepth = TCL_MAX_DEPTH;
+  tcl->budget = -1;
+  tcl->hook = NULL;
+  tcl->hookarg = NULL;
+  tcl->every = tcl->untilhook = 0;
+  tcl->aborted = TCL_ABORT_NONE;
+  tcl->stack = 0;
+  tcl->stackused = 0;
+  tcl_ticks_reset(tcl);
+}
+
+#ifdef TCL_ENABLE_PROFILE
+/* Calls fn for every command that has been called since the last reset */
+void tcl_profile_each(struct tcl *tcl,
+                      void (*fn)(const char *name, const struct tcl_profile *p,
+                                 void *arg),
+                      void *arg) {
+  for (int i = 0; i < tcl->cmdcap; i++) {
+    for (struct tcl_cmd *c = tcl->cmds[i]; c != NULL; c = c->next) {
+      if (c->profile.calls > 0) {
+        fn(tcl_string(c->name->name), &c->profile, arg);
+      }
+    }
+  }
+}
+
+void tcl_profile_reset(struct tcl *tcl) {
+  for (int i = 0; i < tcl->cmdcap; i++) {
+    for (struct tcl_cmd *c = tcl->cmds[i]; c != NULL; c = c->next) {
+      int active = c->profile.active;
+      memset(&c->profile, 0, sizeof(c->profile));
+      c->profile.active = active;
+    }
+  }
+}
+
+static int tcl_profile_cmp(const void *a, const void *b) {
+  const struct tcl_cmd *x = *(struct tcl_cmd *const *)a;
+  const struct tcl_cmd *y = *(struct tcl_cmd *const *)b;
+  if (x->profile.self_ns != y->profile.self_ns) {
+    return (x->profile.self_ns < y->profile.self_ns ? 1 : -1);
+  }
+  return (x->profile.calls < y->profile.calls) -
+         (x->profile.calls > y->profile.calls);
+}
 
-  char *p = buf + sizeof(buf) - 1;
-  char neg = (c < 0);
-  *p-- = 0;
-  if (neg) {
-    c = -c;
+/* Returns one line per called command, the most expensive ones first: the
+ * name, the number of calls, total and self time in nanoseconds and the
+ * number of allocations */
+tcl_value_t *tcl_profile_report(struct tcl *tcl) {
+  int n = 0;
+  struct tcl_cmd **cmds = malloc((tcl->ncmds + 1) * sizeof(struct tcl_cmd *));
+  int cap = tcl->ncmds + 1;
+  for (int i = 0; i < tcl->cmdcap; i++) {
+    for (struct tcl_cmd *c = tcl->cmds[i]; c != NULL; c = c->next) {
+      if (c->profile.calls == 0) {
+        continue;
+      }
+      if (n == cap) {
+        cap = cap * 2;
+        cmds = realloc(cmds, cap * sizeof(struct tcl_cmd *));
+      }
+      cmds[n++] = c;
+    }
   }
-  do {
-    *p-- = '0' + (c % 10);
-    c = c / 10;
-  } while (c > 0);
-  if (neg) {
-    *p-- = '-';
+  qsort(cmds, n, sizeof(struct tcl_cmd *), tcl_profile_cmp);
+  tcl_value_t *report = tcl_value_new(tcl->mem, "", 0);
+  for (int i = 0; i < n; i++) {
+    struct tcl_profile *p = &cmds[i]->profile;
+    tcl_value_t *name =
+        tcl_list_append(tcl_list_alloc(), cmds[i]->name->name);
+    char line[96];
+    int len = snprintf(line, sizeof(line), " %lu %llu %llu %lu\n", p->calls,
+                       p->total_ns, p->self_ns, p->allocs);
+    report = tcl_append(report, name);
+    report = tcl_append_string(report, line, len);
   }
-  p++;
+  free(cmds);
+  return report;
+}
 
-  tcl_free(opval);
-  tcl_free(aval);
-  tcl_free(bval);
-  return tcl_result(tcl, FNORMAL, tcl_alloc(p, strlen(p)));
+static int tcl_cmd_profile(struct tcl *tcl, int argc, tcl_value_t **argv,
+                           void *arg) {
+  (void)arg;
+  if (argc == 2 && strcmp(tcl_string(argv[1]), "reset") == 0) {
+    tcl_profile_reset(tcl);
+    return tcl_result(tcl, FNORMAL, tcl_empty(tcl));
+  }
+  if (argc != 1) {
+    return tcl_result(tcl, FERROR, tcl_empty(tcl));
+  }
+  return tcl_result(tcl, FNORMAL, tcl_profile_report(tcl));
 }
 #endif
 
-void tcl_init(struct tcl *tcl) {
-  tcl->env = tcl_env_alloc(NULL);
-  tcl->result = tcl_alloc("", 0);
+void tcl_init_alloc(struct tcl *tcl, struct tcl_allocator *mem) {
+#ifdef TCL_ENABLE_PROFILE
+  mem = tcl_profile_wrap(&tcl->counter, mem);
+  tcl->nested_ns = 0;
+  tcl->nested_allocs = 0;
+#endif
+  tcl->mem = mem;
+  tcl->empty = tcl_value_new(mem, "", 0);
+  tcl_atoms_init(&tcl->atoms, mem);
+  tcl->env = tcl_env_alloc(mem, NULL);
+  tcl->arena = tcl->spare = NULL;
+  tcl->result = tcl_empty(tcl);
   tcl->cmds = NULL;
-  tcl_register(tcl, "set", tcl_cmd_set, 0, NULL);
-  tcl_register(tcl, "subst", tcl_cmd_subst, 2, NULL);
+  tcl->ncmds = tcl->cmdcap = 0;
+  tcl->cmdgen = 0;
+  tcl->cache = calloc(TCL_CACHE_BUCKETS, sizeof(struct tcl_script *));
+  tcl->ncache = 0;
+  tcl->exprs = calloc(TCL_CACHE_BUCKETS, sizeof(struct tcl_expr *));
+  tcl->nexprs = 0;
+  tcl_limits_init(tcl);
+  tcl_register_argv(tcl, "set", tcl_cmd_set, 0, NULL);
+  tcl_register_argv(tcl, "subst", tcl_cmd_subst, 2, NULL);
 #ifndef TCL_DISABLE_PUTS
-  tcl_register(tcl, "puts", tcl_cmd_puts, 2, NULL);
-#endif
-  tcl_register(tcl, "proc", tcl_cmd_proc, 4, NULL);
-  tcl_register(tcl, "if", tcl_cmd_if, 0, NULL);
-  tcl_register(tcl, "while", tcl_cmd_while, 3, NULL);
-  tcl_register(tcl, "return", tcl_cmd_flow, 0, NULL);
-  tcl_register(tcl, "break", tcl_cmd_flow, 1, NULL);
-  tcl_register(tcl, "continue", tcl_cmd_flow, 1, NULL);
+  tcl_register_argv(tcl, "puts", tcl_cmd_puts, 2, NULL);
+#endif
+#ifndef TCL_DISABLE_SOURCE
+  tcl_register_argv(tcl, "source", tcl_cmd_source, 2, NULL);
+#endif
+  tcl_register_argv(tcl, "proc", tcl_cmd_proc, 4, NULL);
+  tcl_register_argv(tcl, "if", tcl_cmd_if, 0, NULL);
+  tcl_register_argv(tcl, "while", tcl_cmd_while, 3, NULL);
+  tcl_register_argv(tcl, "return", tcl_cmd_flow, 0, NULL);
+  tcl_register_argv(tcl, "break", tcl_cmd_flow, 1, NULL);
+  tcl_register_argv(tcl, "continue", tcl_cmd_flow, 1, NULL);
+  tcl_register_argv(tcl, "expr", tcl_cmd_expr, 0, NULL);
+  tcl_register_argv(tcl, "dict", tcl_cmd_dict, 0, NULL);
+  tcl_register_argv(tcl, "foreach", tcl_cmd_foreach, 4, NULL);
+  tcl_register_argv(tcl, "llength", tcl_cmd_llength, 2, NULL);
+  tcl_register_argv(tcl, "lindex", tcl_cmd_lindex, 0, NULL);
+  tcl_register_argv(tcl, "lappend", tcl_cmd_lappend, 0, NULL);
+  tcl_register_argv(tcl, "lrange", tcl_cmd_lrange, 4, NULL);
+  tcl_register_argv(tcl, "lsort", tcl_cmd_lsort, 0, NULL);
+#ifdef TCL_ENABLE_PROFILE
+  tcl_register_argv(tcl, "profile", tcl_cmd_profile, 0, NULL);
+#endif
 #ifndef TCL_DISABLE_MATH
   char *math[] = {"+", "-", "*", "/", ">", ">=", "<", "<=", "==", "!="};
   for (unsigned int i = 0; i < (sizeof(math) / sizeof(math[0])); i++) {
-    tcl_register(tcl, math[i], tcl_cmd_math, 3, NULL);
+    tcl_register_argv(tcl, math[i], tcl_cmd_math, 3, NULL);
   }
 #endif
 }
 
+void tcl_init(struct tcl *tcl) { tcl_init_alloc(tcl, &tcl_malloc_allocator); }
+
 void tcl_destroy(struct tcl *tcl) {
   while (tcl->env) {
-    tcl->env = tcl_env_free(tcl->env);
+    tcl->env = tcl_env_free(tcl->mem, tcl->env);
+  }
+  if (tcl->spare != NULL) {
+    tcl->mem->free(tcl->mem, tcl->spare, sizeof(struct tcl_arena));
   }
-  while (tcl->cmds) {
-    struct tcl_cmd *cmd = tcl->cmds;
-    tcl->cmds = tcl->cmds->next;
-    tcl_free(cmd->name);
-    free(cmd->arg);
-    free(cmd);
+  for (int i = 0; i < tcl->cmdcap; i++) {
+    while (tcl->cmds[i]) {
+      struct tcl_cmd *cmd = tcl->cmds[i];
+      tcl->cmds[i] = cmd->next;
+      tcl_atom_release(cmd->name);
+      if (cmd->argv_fn == tcl_user_proc) {
+        tcl_proc_free(cmd->arg);
+      } else {
+        free(cmd->arg);
+      }
+      free(cmd);
+    }
   }
+  free(tcl->cmds);
+  tcl_cache_flush(tcl);
+  free(tcl->cache);
+  tcl_expr_flush(tcl);
+  free(tcl->exprs);
   tcl_free(tcl->result);
+  tcl_free(tcl->empty);
+  /* Everything that held an atom has been released by now */
+  free(tcl->atoms.buckets);
 }
 
-#ifndef TEST
-#define CHUNK 1024
+/* Clones copy every value instead of sharing it: reference counts are not
+ * atomic, and a clone may be handed to another thread */
+static tcl_value_t *tcl_value_copy(struct tcl_allocator *mem, tcl_value_t *v) {
+  return (v == NULL ? NULL : tcl_value_new(mem, tcl_string(v), tcl_length(v)));
+}
+
+static struct tcl_script *tcl_script_copy(struct tcl_script *script);
+
+static struct tcl_expr *tcl_expr_copy(struct tcl_expr *expr) {
+  struct tcl_expr *copy = malloc(sizeof(struct tcl_expr));
+  *copy = *expr;
+  copy->ops = malloc(expr->nops * sizeof(int));
+  for (int i = 0; i < expr->nops; i++) {
+    copy->ops[i] = expr->ops[i];
+  }
+  copy->names = malloc(expr->nnames * sizeof(tcl_value_t *));
+  for (int i = 0; i < expr->nnames; i++) {
+    copy->names[i] = tcl_value_copy(&tcl_malloc_allocator, expr->names[i]);
+  }
+  copy->atoms = calloc(expr->nnames, sizeof(struct tcl_atom *));
+  copy->scripts = malloc(expr->nscripts * sizeof(struct tcl_script *));
+  for (int i = 0; i < expr->nscripts; i++) {
+    copy->scripts[i] = tcl_script_copy(expr->scripts[i]);
+  }
+  copy->refs = 1;
+  copy->src = tcl_value_copy(&tcl_malloc_allocator, expr->src);
+  copy->next = NULL;
+  return copy;
+}
+
+static struct tcl_code *tcl_code_copy(struct tcl_code *code) {
+  if (code == NULL) {
+    return NULL;
+  }
+  struct tcl_code *copy = malloc(sizeof(struct tcl_code));
+  *copy = *code;
+  copy->ops = malloc(code->nops * sizeof(int));
+  for (int i = 0; i < code->nops; i++) {
+    copy->ops[i] = code->ops[i];
+  }
+  copy->consts = malloc(code->nconsts * sizeof(tcl_value_t *));
+  for (int i = 0; i < code->nconsts; i++) {
+    copy->consts[i] = tcl_value_copy(&tcl_malloc_allocator, code->consts[i]);
+  }
+  copy->atoms = calloc(code->nconsts, sizeof(struct tcl_atom *));
+  copy->sites = malloc(code->nsites * sizeof(struct tcl_site));
+  for (int i = 0; i < code->nsites; i++) {
+    copy->sites[i] = code->sites[i];
+    copy->sites[i].name =
+        tcl_value_copy(&tcl_malloc_allocator, code->sites[i].name);
+    copy->sites[i].cmd = NULL;
+  }
+  copy->exprs = malloc(code->nexprs * sizeof(struct tcl_expr *));
+  for (int i = 0; i < code->nexprs; i++) {
+    copy->exprs[i] = tcl_expr_copy(code->exprs[i]);
+  }
+  return copy;
+}
+
+static void tcl_part_copy(struct tcl_part *copy, struct tcl_part *part) {
+  *copy = *part;
+  copy->value = tcl_value_copy(&tcl_malloc_allocator, part->value);
+  if (part->name != NULL) {
+    copy->name = malloc(sizeof(struct tcl_part));
+    tcl_part_copy(copy->name, part->name);
+  }
+  if (part->script != NULL) {
+    copy->script = tcl_script_copy(part->script);
+  }
+}
+
+static struct tcl_script *tcl_script_copy(struct tcl_script *script) {
+  struct tcl_script *copy = malloc(sizeof(struct tcl_script));
+  *copy = *script;
+  copy->cmds = malloc(script->ncmds * sizeof(struct tcl_command));
+  for (int i = 0; i < script->ncmds; i++) {
+    struct tcl_command *cmd = &copy->cmds[i];
+    *cmd = script->cmds[i];
+    cmd->cmd = NULL;
+    cmd->words = malloc(cmd->nwords * sizeof(struct tcl_word));
+    for (int j = 0; j < cmd->nwords; j++) {
+      struct tcl_word *word = &script->cmds[i].words[j];
+      cmd->words[j].nparts = word->nparts;
+      cmd->words[j].parts = malloc(word->nparts * sizeof(struct tcl_part));
+      for (int k = 0; k < word->nparts; k++) {
+        tcl_part_copy(&cmd->words[j].parts[k], &word->parts[k]);
+      }
+    }
+  }
+  copy->refs = 1;
+  copy->code = tcl_code_copy(script->code);
+  copy->src = tcl_value_copy(&tcl_malloc_allocator, script->src);
+  copy->next = NULL;
+  return copy;
+}
+
+static struct tcl_proc *tcl_proc_copy(struct tcl_atoms *atoms,
+                                      struct tcl_proc *proc) {
+  struct tcl_proc *copy = malloc(sizeof(struct tcl_proc));
+  copy->nparams = proc->nparams;
+  copy->params = malloc(proc->nparams * sizeof(tcl_value_t *));
+  copy->atoms = malloc(proc->nparams * sizeof(struct tcl_atom *));
+  for (int i = 0; i < proc->nparams; i++) {
+    copy->params[i] = tcl_value_copy(&tcl_malloc_allocator, proc->params[i]);
+    copy->atoms[i] = tcl_atom(atoms, proc->params[i]);
+  }
+  copy->body = (proc->body != NULL ? tcl_script_copy(proc->body) : NULL);
+  copy->code = tcl_code_copy(proc->code);
+  return copy;
+}
+
+static struct tcl_env *tcl_env_copy(struct tcl_allocator *mem,
+                                    struct tcl_atoms *atoms,
+                                    struct tcl_env *env) {
+  if (env == NULL) {
+    return NULL;
+  }
+  struct tcl_env *copy =
+      tcl_env_alloc(mem, tcl_env_copy(mem, atoms, env->parent));
+  for (int i = 0; i < env->nvars; i++) {
+    struct tcl_atom *name = tcl_atom(atoms, env->vars[i].name->name);
+    tcl_value_t *value = tcl_value_copy(mem, env->vars[i].value);
+    tcl_env_var(mem, copy, name, value);
+    tcl_atom_release(name);
+    tcl_free(value);
+  }
+  return copy;
+}
+
+/* Initializes dst as a copy of src: variables, commands and procedures with
+ * their compiled bodies, so nothing is parsed or compiled again. Commands
+ * registered with an argument can't be copied, as the argument is owned by
+ * src; in this case -1 is returned and dst is not initialized */
+int tcl_clone_alloc(struct tcl *dst, struct tcl *src,
+                    struct tcl_allocator *mem) {
+  for (int i = 0; i < src->cmdcap; i++) {
+    for (struct tcl_cmd *c = src->cmds[i]; c != NULL; c = c->next) {
+      if (c->argv_fn != tcl_user_proc && c->arg != NULL) {
+        return -1;
+      }
+    }
+  }
+#ifdef TCL_ENABLE_PROFILE
+  mem = tcl_profile_wrap(&dst->counter, mem);
+  dst->nested_ns = 0;
+  dst->nested_allocs = 0;
+#endif
+  dst->mem = mem;
+  dst->empty = tcl_value_new(mem, "", 0);
+  tcl_atoms_init(&dst->atoms, mem);
+  dst->env = tcl_env_copy(mem, &dst->atoms, src->env);
+  dst->arena = dst->spare = NULL;
+  dst->result = tcl_value_copy(mem, src->result);
+  /* The command table keeps its layout, so every chain stays in its slot */
+  dst->cmds = calloc(src->cmdcap, sizeof(struct tcl_cmd *));
+  dst->ncmds = src->ncmds;
+  dst->cmdcap = src->cmdcap;
+  for (int i = 0; i < src->cmdcap; i++) {
+    struct tcl_cmd **tail = &dst->cmds[i];
+    for (struct tcl_cmd *c = src->cmds[i]; c != NULL; c = c->next) {
+      struct tcl_cmd *cmd = malloc(sizeof(struct tcl_cmd));
+      *cmd = *c;
+      cmd->name = tcl_atom(&dst->atoms, c->name->name);
+      if (c->argv_fn == tcl_user_proc) {
+        cmd->arg = tcl_proc_copy(&dst->atoms, c->arg);
+      }
+#ifdef TCL_ENABLE_PROFILE
+      memset(&cmd->profile, 0, sizeof(cmd->profile));
+#endif
+      cmd->next = NULL;
+      *tail = cmd;
+      tail = &cmd->next;
+    }
+  }
+  /* Commands cached by the copied code point into src, make them stale */
+  dst->cmdgen = src->cmdgen + 1;
+  dst->cache = calloc(TCL_CACHE_BUCKETS, sizeof(struct tcl_script *));
+  dst->ncache = 0;
+  dst->exprs = calloc(TCL_CACHE_BUCKETS, sizeof(struct tcl_expr *));
+  dst->nexprs = 0;
+  tcl_limits_init(dst);
+  return 0;
+}
+
+/* The clone allocates with malloc, not with the allocator of src, which may be
+ * a pool that can't be used by two threads at once */
+int tcl_clone(struct tcl *dst, struct tcl *src) {
+  return tcl_clone_alloc(dst, src, &tcl_malloc_allocator);
+}
+
+#ifdef TCL_ENABLE_POOL
+/* A worker pool runs scripts on a fixed set of threads, each with its own
+ * interpreter. Every worker owns a queue of jobs: the worker takes the most
+ * recent job from the back of its queue, idle workers steal the oldest jobs
+ * from the front of the other queues. Scripts must stay valid until their job
+ * is done */
+struct tcl_job {
+  const char *s;
+  size_t len;
+  void (*done)(struct tcl *tcl, int flow, void *arg);
+  void *arg;
+};
+
+struct tcl_queue {
+  pthread_mutex_t lock;
+  struct tcl_job *jobs;
+  size_t head;
+  size_t count;
+  size_t cap;
+};
 
-int main() {
+struct tcl_worker {
   struct tcl tcl;
-  int buflen = CHUNK;
-  char *buf = malloc(buflen);
-  int i = 0;
+  struct tcl_queue queue;
+  struct tcl_workers *pool;
+  pthread_t thread;
+};
 
-  tcl_init(&tcl);
-  while (1) {
-    int inp = fgetc(stdin);
+struct tcl_workers {
+  struct tcl_worker *workers;
+  int n;
+  int next;       /* Queue that receives the next job */
+  size_t queued;  /* Jobs waiting in the queues */
+  size_t pending; /* Jobs that are not done yet */
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t work; /* Signalled when a job is queued */
+  pthread_cond_t idle; /* Signalled when all jobs are done */
+};
+
+static void tcl_queue_push(struct tcl_queue *q, struct tcl_job *job) {
+  pthread_mutex_lock(&q->lock);
+  if (q->count == q->cap) {
+    size_t cap = q->cap ? q->cap * 2 : 16;
+    struct tcl_job *jobs = malloc(cap * sizeof(*jobs));
+    for (size_t i = 0; i < q->count; i++) {
+      jobs[i] = q->jobs[(q->head + i) % q->cap];
+    }
+    free(q->jobs);
+    q->jobs = jobs;
+    q->head = 0;
+    q->cap = cap;
+  }
+  q->jobs[(q->head + q->count) % q->cap] = *job;
+  q->count++;
+  pthread_mutex_unlock(&q->lock);
+}
+
+/* Takes a job from the back (own queue) or from the front (stealing) */
+static int tcl_queue_take(struct tcl_queue *q, struct tcl_job *job,
+                          int steal) {
+  int found = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->count > 0) {
+    if (steal) {
+      *job = q->jobs[q->head];
+      q->head = (q->head + 1) % q->cap;
+    } else {
+      *job = q->jobs[(q->head + q->count - 1) % q->cap];
+    }
+    q->count--;
+    found = 1;
+  }
+  pthread_mutex_unlock(&q->lock);
+  return found;
+}
+
+static int tcl_worker_take(struct tcl_worker *w, struct tcl_job *job) {
+  struct tcl_workers *pool = w->pool;
+  int self = (int)(w - pool->workers);
+  for (int i = 0; i < pool->n; i++) {
+    int k = (self + i) % pool->n;
+    if (tcl_queue_take(&pool->workers[k].queue, job, i > 0)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void *tcl_worker_run(void *arg) {
+  struct tcl_worker *w = arg;
+  struct tcl_workers *pool = w->pool;
+  struct tcl_job job;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->queued == 0 && !pool->stop) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    if (pool->queued == 0) {
+      break;
+    }
+    /* Claim a job first, there is always one left in some queue for it */
+    pool->queued--;
+    pthread_mutex_unlock(&pool->lock);
+    while (!tcl_worker_take(w, &job)) {
+    }
+    int flow = tcl_eval(&w->tcl, job.s, job.len);
+    if (job.done != NULL) {
+      job.done(&w->tcl, flow, job.arg);
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->pending == 0) {
+      pthread_cond_broadcast(&pool->idle);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
 
-    if (i > buflen - 1) {
-      buf = realloc(buf, buflen += CHUNK);
+/* Starts n workers. The init function (if any) is called for each interpreter
+ * before the threads start, e.g. to register extra commands. Returns -1 if
+ * not all the threads could be started. A pool without workers rejects jobs,
+ * waiting for it and destroying it do nothing */
+int tcl_workers_init(struct tcl_workers *pool, int n,
+                     void (*init)(struct tcl *tcl, void *arg), void *arg) {
+  memset(pool, 0, sizeof(*pool));
+  pool->workers = (n > 0 ? calloc(n, sizeof(struct tcl_worker)) : NULL);
+  if (pool->workers == NULL) {
+    return -1;
+  }
+  pool->n = n;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->idle, NULL);
+  for (int i = 0; i < n; i++) {
+    struct tcl_worker *w = &pool->workers[i];
+    tcl_init(&w->tcl);
+    if (init != NULL) {
+      init(&w->tcl, arg);
+    }
+    pthread_mutex_init(&w->queue.lock, NULL);
+    w->pool = pool;
+  }
+  int started = 0;
+  while (started < n && pthread_create(&pool->workers[started].thread, NULL,
+                                       tcl_worker_run,
+                                       &pool->workers[started]) == 0) {
+    started++;
+  }
+  if (started < n) {
+    /* The pool goes on with the workers that started, and must still be
+     * destroyed. The interpreters and queues of the others are released here,
+     * since tcl_workers_destroy() only knows about the first pool->n */
+    for (int i = started; i < n; i++) {
+      tcl_destroy(&pool->workers[i].tcl);
+      pthread_mutex_destroy(&pool->workers[i].queue.lock);
+    }
+    pool->n = started;
+    if (started == 0) {
+      free(pool->workers);
+      pool->workers = NULL;
+      pthread_mutex_destroy(&pool->lock);
+      pthread_cond_destroy(&pool->work);
+      pthread_cond_destroy(&pool->idle);
     }
+    return -1;
+  }
+  return 0;
+}
+
+/* Queues a script (len includes the terminating NUL, as in tcl_eval). The done
+ * function is called on the worker thread with the interpreter that evaluated
+ * the script, its result must be copied before the function returns. Returns
+ * -1 if the pool has no workers */
+int tcl_workers_submit(struct tcl_workers *pool, const char *s, size_t len,
+                       void (*done)(struct tcl *tcl, int flow, void *arg),
+                       void *arg) {
+  struct tcl_job job = {s, len, done, arg};
+  if (pool->n == 0) {
+    return -1;
+  }
+  pthread_mutex_lock(&pool->lock);
+  int k = pool->next;
+  pool->next = (pool->next + 1) % pool->n;
+  pool->pending++;
+  pthread_mutex_unlock(&pool->lock);
+  tcl_queue_push(&pool->workers[k].queue, &job);
+  pthread_mutex_lock(&pool->lock);
+  pool->queued++;
+  pthread_cond_signal(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+/* Waits until all submitted jobs are done */
+void tcl_workers_wait(struct tcl_workers *pool) {
+  if (pool->n == 0) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending > 0) {
+    pthread_cond_wait(&pool->idle, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Finishes the queued jobs, stops the threads and destroys the interpreters */
+void tcl_workers_destroy(struct tcl_workers *pool) {
+  if (pool->n == 0) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->stop = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->n; i++) {
+    pthread_join(pool->workers[i].thread, NULL);
+  }
+  for (int i = 0; i < pool->n; i++) {
+    struct tcl_worker *w = &pool->workers[i];
+    tcl_destroy(&w->tcl);
+    free(w->queue.jobs);
+    pthread_mutex_destroy(&w->queue.lock);
+  }
+  free(pool->workers);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->idle);
+}
+#endif
+
+#ifndef TEST
+#define CHUNK 1024
 
-    if (inp == 0 || inp == EOF) {
+/* Reads a block of at most n bytes, or a line in interactive mode so that a
+ * command is evaluated as soon as it is typed. Returns the number of bytes
+ * read, which may include NULs */
+static size_t tcl_read(char *buf, size_t n, FILE *f, int interactive) {
+  if (!interactive) {
+    return fread(buf, 1, n, f);
+  }
+  size_t i = 0;
+  for (int c; i < n && (c = getc(f)) != EOF;) {
+    buf[i++] = (char)c;
+    if (c == '\n') {
       break;
     }
+  }
+  return i;
+}
 
-    buf[i++] = inp;
+/* Evaluates commands from the stream as soon as they are complete. The buffer
+ * only holds the command being read. In interactive mode every result is
+ * printed, otherwise evaluation stops at the first error */
+static int tcl_eval_stream(struct tcl *tcl, FILE *f, int interactive) {
+  struct tcl_reader reader = {0, 0, 0, 0};
+  size_t cap = CHUNK;
+  size_t len = 0;
+  char *buf = malloc(cap);
+  int eof = 0;
+  int status = 0;
 
-    tcl_each(buf, i, 1) {
-      if (p.token == TERROR && (p.to - buf) != i) {
-        memset(buf, 0, buflen);
-        i = 0;
+  while (!eof && status == 0) {
+    size_t n = tcl_read(buf + len, cap - len - 1, f, interactive);
+    if (n == 0) {
+      if (len == 0) {
         break;
-      } else if (p.token == TCMD && *(p.from) != '\0') {
-        int r = tcl_eval(&tcl, buf, strlen(buf));
-        if (r != FERROR) {
-          printf("result> %.*s\n", tcl_length(tcl.result),
-                 tcl_string(tcl.result));
-        } else {
-          printf("?!\n");
-        }
-
-        memset(buf, 0, buflen);
-        i = 0;
+      }
+      /* The last command may lack a separator, NUL terminates it */
+      buf[len] = '\0';
+      eof = n = 1;
+    }
+    size_t start = 0;
+    for (size_t i = len; i < len + n && status == 0;) {
+      size_t end = tcl_reader_feed(&reader, buf + i, len + n - i);
+      if (end == 0) {
         break;
       }
+      i = i + end;
+      int r = tcl_eval(tcl, buf + start, i - start);
+      if (interactive && r != FERROR) {
+        printf("result> %.*s\n", tcl_length(tcl->result),
+               tcl_string(tcl->result));
+      } else if (r == FERROR) {
+        printf("?!\n");
+        status = !interactive;
+      }
+      start = i;
+    }
+    len = len + n - start;
+    memmove(buf, buf + start, len);
+    if (len + 1 >= cap) {
+      buf = realloc(buf, cap = cap * 2);
     }
   }
-
   free(buf);
-
-  if (i) {
+  if (status == 0 && len > 0) {
     printf("incomplete input\n");
-    return -1;
+    status = -1;
   }
+  return status;
+}
 
-  return 0;
+int main(int argc, char *argv[]) {
+  struct tcl tcl;
+  int status;
+
+  tcl_init(&tcl);
+  if (argc > 1 && strcmp(argv[1], "-") != 0) {
+#ifndef TCL_DISABLE_SOURCE
+    status = (tcl_eval_file(&tcl, argv[1]) == FERROR);
+    if (status) {
+      printf("?!\n");
+    }
+#else
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+      perror(argv[1]);
+      return 1;
+    }
+    status = tcl_eval_stream(&tcl, f, 0);
+    fclose(f);
+#endif
+  } else {
+    status = tcl_eval_stream(&tcl, stdin, argc == 1);
+  }
+  tcl_destroy(&tcl);
+  return status;
 }
 #endif
@@ -0,0 +1,301 @@
+#define _POSIX_C_SOURCE 200809L /* clock_gettime() */
+
+#include <stdio.h>
+#include <time.h>
+
+#define TEST
+#include "tcl.c"
+
+/* Allocator that counts allocations on top of malloc */
+struct counter {
+  struct tcl_allocator mem; /* Must be the first field */
+  long allocs;
+};
+
+static void *counter_alloc(struct tcl_allocator *mem, size_t size) {
+  ((struct counter *)mem)->allocs++;
+  return malloc(size);
+}
+
+static void *counter_realloc(struct tcl_allocator *mem, void *p, size_t old,
+                             size_t size) {
+  (void)old;
+  ((struct counter *)mem)->allocs++;
+  return realloc(p, size);
+}
+
+static void counter_free(struct tcl_allocator *mem, void *p, size_t size) {
+  (void)mem;
+  (void)size;
+  free(p);
+}
+
+static struct counter counter = {
+    {counter_alloc, counter_realloc, counter_free}, 0};
+
+/* Prints one line per benchmark: name, number of operations, time and
+ * allocations per operation, separated by tabs */
+static void report(const char *name, long n, clock_t start, long allocs) {
+  double ns = (double)(clock() - start) * 1e9 / CLOCKS_PER_SEC;
+  printf("%s\t%ld\t%.1f\t%.2f\n", name, n, ns / n,
+         (double)(counter.allocs - allocs) / n);
+}
+
+static void bench_list_append(int n) {
+  tcl_value_t *item = tcl_value_new(&counter.mem, "item", 4);
+  tcl_value_t *quoted = tcl_value_new(&counter.mem, "two words", 9);
+  long allocs = counter.allocs;
+  clock_t start = clock();
+  tcl_value_t *list = tcl_value_alloc(&counter.mem, TCL_VALUE_LIST);
+  for (int i = 0; i < n; i++) {
+    list = tcl_list_append(list, (i % 2) ? item : quoted);
+  }
+  report("list_append", n, start, allocs);
+  tcl_list_free(list);
+  tcl_free(item);
+  tcl_free(quoted);
+}
+
+static void bench_string_append(int n) {
+  tcl_value_t *chunk = tcl_value_new(&counter.mem, "chunk", 5);
+  long allocs = counter.allocs;
+  clock_t start = clock();
+  tcl_value_t *s = tcl_value_new(&counter.mem, "", 0);
+  for (int i = 0; i < n; i++) {
+    s = tcl_append(s, tcl_dup(chunk));
+  }
+  report("string_append", n, start, allocs);
+  tcl_free(s);
+  tcl_free(chunk);
+}
+
+/* Evaluates the script reps times, each evaluation counts as ops operations */
+static void bench_script(const char *name, const char *setup,
+                         const char *script, int reps, int ops) {
+  struct tcl tcl;
+  tcl_init_alloc(&tcl, &counter.mem);
+  if (tcl_eval(&tcl, setup, strlen(setup) + 1) == FERROR) {
+    printf("# %s: setup failed\n", name);
+  }
+  long allocs = counter.allocs;
+  clock_t start = clock();
+  for (int i = 0; i < reps; i++) {
+    if (tcl_eval(&tcl, script, strlen(script) + 1) == FERROR) {
+      printf("# %s: script failed\n", name);
+      break;
+    }
+  }
+  report(name, (long)reps * ops, start, allocs);
+  tcl_destroy(&tcl);
+}
+
+/* Procedures on heap frames: recursion as in "fib", deep recursion that the
+ * default depth wouldn't allow, and tail calls */
+static void bench_frames(int reps) {
+  const char *names[] = {"fib_frames", "deep_frames", "tail_frames"};
+  const char *scripts[] = {"fib 15", "deep 10000", "loop 10000"};
+  const char *setup =
+      "proc fib {x} { if {<= $x 1} {return 1} "
+      "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; "
+      "proc deep {n} {if {== $n 0} {return 0} {return [+ 1 [deep [- $n 1]]]}}; "
+      "proc loop {n} {if {== $n 0} {return 0} {return [loop [- $n 1]]}}";
+  int ops[] = {1, 10000, 10000};
+  for (int i = 0; i < 3; i++) {
+    struct tcl tcl;
+    tcl_init_alloc(&tcl, &counter.mem);
+    tcl_set_stack(&tcl, 16 << 20);
+    tcl_eval(&tcl, setup, strlen(setup) + 1);
+    long allocs = counter.allocs;
+    clock_t start = clock();
+    for (int j = 0; j < reps; j++) {
+      if (tcl_eval(&tcl, scripts[i], strlen(scripts[i]) + 1) == FERROR) {
+        printf("# %s: script failed\n", names[i]);
+        break;
+      }
+    }
+    report(names[i], (long)reps * ops[i], start, allocs);
+    tcl_destroy(&tcl);
+  }
+}
+
+static void bench_nesting(int depth, int reps) {
+  tcl_value_t *s = tcl_alloc("", 0);
+  for (int i = 0; i < depth; i++) {
+    s = tcl_append_string(s, "+ 1 [", 5);
+  }
+  s = tcl_append_string(s, "+ 0 0", 5);
+  for (int i = 0; i < depth; i++) {
+    s = tcl_append_string(s, "]", 1);
+  }
+  bench_script("nesting", "", tcl_string(s), reps, 1);
+  tcl_free(s);
+}
+
+static void bench_lexer(int lines, int reps) {
+  tcl_value_t *s = tcl_alloc("", 0);
+  for (int i = 0; i < lines; i++) {
+    char line[64];
+    int n = snprintf(line, sizeof(line),
+                     "set x%d [+ $y \"a $b\"] {c [d] e};\n", i);
+    s = tcl_append_string(s, line, n);
+  }
+  long tokens = 0;
+  long allocs = counter.allocs;
+  clock_t start = clock();
+  for (int i = 0; i < reps; i++) {
+    tcl_each(tcl_string(s), tcl_length(s) + 1, 1) { tokens++; }
+  }
+  report("lexer", tokens, start, allocs);
+  tcl_free(s);
+}
+
+/* Long words and brace-quoted bodies, measured per byte */
+static void bench_lexer_bytes(int procs, int reps) {
+  tcl_value_t *s = tcl_alloc("", 0);
+  for (int i = 0; i < procs; i++) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "proc p%d {a b} {\n", i);
+    s = tcl_append_string(s, line, n);
+    for (int j = 0; j < 20; j++) {
+      s = tcl_append_string(s, "  set some_long_variable_name [+ $a $b]\n", 41);
+    }
+    s = tcl_append_string(s, "}\nset description_of_the_item ", 31);
+    s = tcl_append_string(s, "a_rather_long_literal_value_for_the_item\n", 41);
+  }
+  long bytes = 0;
+  long allocs = counter.allocs;
+  clock_t start = clock();
+  for (int i = 0; i < reps; i++) {
+    tcl_each(tcl_string(s), tcl_length(s) + 1, 1) {}
+    bytes += tcl_length(s);
+  }
+  report("lexer_bytes", bytes, start, allocs);
+  tcl_free(s);
+}
+
+/* Starting an interpreter with a library of procedures: by evaluating the
+ * library, or by cloning an interpreter that already has it */
+static void bench_clone(int procs, int reps) {
+  tcl_value_t *lib = tcl_alloc("", 0);
+  for (int i = 0; i < procs; i++) {
+    char line[128];
+    int n = snprintf(line, sizeof(line),
+                     "proc p%d {a b} {set c [+ $a $b]; "
+                     "while {< $c 10} {set c [* $c 2]}; return $c}\n",
+                     i);
+    lib = tcl_append_string(lib, line, n);
+  }
+  struct tcl src;
+  tcl_init_alloc(&src, &counter.mem);
+  tcl_eval(&src, tcl_string(lib), tcl_length(lib) + 1);
+  long allocs = counter.allocs;
+  clock_t start = clock();
+  for (int i = 0; i < reps; i++) {
+    struct tcl tcl;
+    tcl_init_alloc(&tcl, &counter.mem);
+    tcl_eval(&tcl, tcl_string(lib), tcl_length(lib) + 1);
+    tcl_destroy(&tcl);
+  }
+  report("init_library", reps, start, allocs);
+  allocs = counter.allocs;
+  start = clock();
+  for (int i = 0; i < reps; i++) {
+    struct tcl tcl;
+    tcl_clone_alloc(&tcl, &src, &counter.mem);
+    tcl_destroy(&tcl);
+  }
+  report("clone_library", reps, start, allocs);
+  tcl_destroy(&src);
+  tcl_free(lib);
+}
+
+#ifdef TCL_ENABLE_POOL
+/* Runs the same jobs on 1, 2, 4... workers up to the number of cores. Time is
+ * measured by the wall clock, so ns/op should halve as the workers double */
+static void bench_workers(int jobs) {
+  const char *script = "proc fib {x} { if {<= $x 1} {return 1} "
+                       "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; fib 15";
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int n = 1; n <= cores; n = n * 2) {
+    struct tcl_workers pool;
+    struct timespec start, end;
+    if (tcl_workers_init(&pool, n, NULL, NULL) != 0) {
+      printf("# workers_%d: failed to start the workers\n", n);
+      tcl_workers_destroy(&pool);
+      break;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < jobs; i++) {
+      tcl_workers_submit(&pool, script, strlen(script) + 1, NULL, NULL);
+    }
+    tcl_workers_wait(&pool);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    tcl_workers_destroy(&pool);
+    double ns = (double)(end.tv_sec - start.tv_sec) * 1e9 +
+                (double)(end.tv_nsec - start.tv_nsec);
+    printf("workers_%d\t%d\t%.1f\t-\n", n, jobs, ns / jobs);
+  }
+}
+#endif
+
+int main() {
+  printf("# name\tops\tns/op\tallocs/op\n");
+  /* Time per operation should stay flat as the size grows */
+  for (int n = 10000; n <= 640000; n = n * 4) {
+    bench_list_append(n);
+  }
+  for (int n = 10000; n <= 640000; n = n * 4) {
+    bench_string_append(n);
+  }
+  bench_script("fib",
+               "proc fib {x} { if {<= $x 1} {return 1} "
+               "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}",
+               "fib 15", 20, 1);
+  bench_script("while", "",
+               "set i 0; while {< $i 10000} {set i [+ $i 1]}", 20, 10000);
+  bench_script("while_expr", "",
+               "set i 0; while {expr {$i < 10000}} {set i [expr {$i + 1}]}",
+               20, 10000);
+  bench_script("arith", "set a 3; set b 4; set c 5",
+               "set i 0; while {< $i 1000} {set x [+ [* $a $b] $c]; "
+               "set i [+ $i 1]}",
+               20, 1000);
+  bench_script("arith_expr", "set a 3; set b 4; set c 5",
+               "set i 0; while {expr {$i < 1000}} "
+               "{set x [expr {$a * $b + $c}]; set i [expr {$i + 1}]}",
+               20, 1000);
+  bench_script("string_build", "",
+               "set s {}; set i 0; "
+               "while {< $i 1000} {set s \"$s$i \"; set i [+ $i 1]}",
+               20, 1000);
+  bench_script("proc_vars",
+               "proc f {a b c d e f g h} {set i [+ $a $b]; set j [+ $c $d]; "
+               "set k [+ $e $f]; set l [+ $g $h]; + [+ $i $j] [+ $k $l]}",
+               "set n 0; while {< $n 1000} {f 1 2 3 4 5 6 7 8; "
+               "set n [+ $n 1]}",
+               20, 1000);
+  /* List commands on 100k items */
+  const char *list = "set l {}; set i 0; while {< $i 100000} "
+                     "{lappend l [- 100000 $i]; set i [+ $i 1]}";
+  bench_script("lappend", "", list, 5, 100000);
+  bench_script("foreach", list, "foreach x $l {}", 5, 100000);
+  bench_script("lsort", list, "lsort $l", 5, 100000);
+  bench_script("lsort_integer", list, "lsort -integer $l", 5, 100000);
+  bench_script("dict_set", "",
+               "set d {}; set i 0; "
+               "while {< $i 1000} {dict set d k$i $i; set i [+ $i 1]}",
+               20, 1000);
+  bench_script("dict_get",
+               "set i 0; while {< $i 1000} {dict set d k$i $i; set i [+ $i 1]}",
+               "set i 0; while {< $i 1000} {dict get $d k$i; set i [+ $i 1]}",
+               20, 1000);
+  bench_frames(20);
+  bench_nesting(100, 1000);
+  bench_lexer(10000, 20);
+  bench_lexer_bytes(1000, 50);
+  bench_clone(50, 200);
+#ifdef TCL_ENABLE_POOL
+  bench_workers(200);
+#endif
+  return 0;
+}
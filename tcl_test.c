@@ -1,3 +1,5 @@
+#define _POSIX_C_SOURCE 200809L /* clock_gettime() */
+
 #include <stdio.h>
 
 #define TEST
@@ -18,10 +20,16 @@ int status = 0;
 
 #include "tcl_test_math.h"
 
+#include "tcl_test_list.h"
+
+#include "tcl_test_pool.h"
+
 int main() {
   test_lexer();
   test_subst();
   test_flow();
   test_math();
+  test_list();
+  test_pool();
   return status;
 }
@@ -1,6 +1,45 @@
 #ifndef TCL_TEST_FLOW_H
 #define TCL_TEST_FLOW_H
 
+static int test_cmd_args(struct tcl *tcl, tcl_value_t *args, void *arg) {
+  (void)arg;
+  return tcl_result(tcl, FNORMAL, tcl_dup(args));
+}
+
+static int test_cmd_argc(struct tcl *tcl, int argc, tcl_value_t **argv,
+                         void *arg) {
+  (void)arg;
+  (void)argv;
+  return tcl_result(tcl, FNORMAL, tcl_int_alloc(argc));
+}
+
+#ifdef TCL_ENABLE_PROFILE
+static void test_profile_cmd(const char *name, const struct tcl_profile *p,
+                             void *arg) {
+  struct tcl_profile *fib = arg;
+  if (strcmp(name, "fib") == 0) {
+    *fib = *p;
+  }
+}
+#endif
+
+static void check_abort(struct tcl *tcl, const char *s, int reason) {
+  if (tcl_eval(tcl, s, strlen(s) + 1) != FERROR) {
+    FAIL("Expected an error (%s)\n", s);
+  } else if (tcl->aborted != reason) {
+    FAIL("Expected abort reason %d, but got %d (%s)\n", reason, tcl->aborted,
+         s);
+  } else {
+    printf("OK: %s -> aborted\n", s);
+  }
+}
+
+static int test_hook(struct tcl *tcl, void *arg) {
+  (void)tcl;
+  int *calls = arg;
+  return ++*calls >= 5;
+}
+
 static void test_flow() {
   printf("\n");
   printf("##########################\n");
@@ -34,11 +73,58 @@ static void test_flow() {
   check_eval(NULL, "proc foo {a} { subst $a }; foo hello", "hello");
   check_eval(NULL, "proc foo {} { subst hello; return A; return B;}; foo", "A");
   check_eval(NULL, "set x 1; proc two {} { set x 2;}; two; subst $x", "1");
+  check_eval(NULL,
+             "proc f {a b c d e f g h i j} {+ $a $j}; f 1 2 3 4 5 6 7 8 9 10",
+             "11");
+  check_eval(NULL, "proc f {a a} {subst $a}; f 1 2", "2");
+  check_eval(NULL, "set i 0; while {< $i 20} {set v$i $i; set i [+ $i 1]}; "
+                   "subst $v17",
+             "17");
+  check_eval(NULL, "proc f {} {subst A}; set i 0; while {< $i 2} "
+                   "{set r [f]; proc f {} {subst B}; set i [+ $i 1]}; subst $r",
+             "B");
   /* Example from Picol */
   check_eval(NULL, "proc fib {x} { if {<= $x 1} {return 1} "
                    "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; fib 20",
              "10946");
 
+  /* Compiled procedure bodies */
+  check_eval(NULL, "proc f {n} {set i 0; set s 0; while {< $i $n} "
+                   "{set i [+ $i 1]; if {== $i 3} {continue}; "
+                   "if {> $i 6} {break}; set s [+ $s $i]}; return $s}; f 10",
+             "18");
+  check_eval(NULL, "proc f {} {set r {}; set i 0; while {< $i 3} {set j 0; "
+                   "while {== 1 1} {set j [+ $j 1]; if {> $j $i} {break}; "
+                   "set r \"$r$i$j \"}; set i [+ $i 1]}; return $r}; f",
+             "11 21 22 ");
+  check_eval(NULL, "proc f {} {set x [break; subst A]; return x$x}; f",
+             "xbreak");
+  check_eval(NULL, "proc f {a} {set v$a 7; set n v$a; return $$n}; f 1",
+             "7");
+  check_eval(NULL, "proc f {} {+ 1 [+ 1 [+ 1 [+ 1 [+ 1 [+ 1 [+ 1 [+ 1 [+ 1 "
+                   "[+ 1 0]]]]]]]]]}; f",
+             "10");
+  check_eval(NULL, "proc f {} {while {== 1 1} {break}}; proc while {a b} "
+                   "{return W}; f",
+             "W");
+  check_eval(NULL, "proc f {x} {if {== $x 1} {return A} {return B}}; "
+                   "set a [f 1]; proc if {a b c} {return C}; subst $a[f 1]",
+             "AC");
+  check_eval(NULL, "proc f {x} {set a $x; set b $ a}; f 5", "");
+  check_eval(NULL, "proc f {} {set i 0; while {< $i 5} {set i [+ $i 1]; "
+                   "if {< $i 3} {continue}; return [* $i 10]}}; f",
+             "30");
+  check_eval(NULL, "set x [return 5]; subst $x", "5");
+  check_eval(NULL, "set b {set i [+ $i 1]; if {== $i 4} {break}}; set i 0; "
+                   "while {< $i 10} $b; subst $i",
+             "4");
+  check_eval(NULL, "proc break {} {return B}; set i 0; "
+                   "while {< $i 3} {set i [+ $i 1]; break}; subst $i",
+             "3");
+  check_eval(NULL, "proc return {a} {subst R$a}; proc f {} {return 1; "
+                   "subst X}; f",
+             "X");
+
   struct tcl tcl;
   tcl_init(&tcl);
   check_eval(&tcl, "proc square {x} { * $x $x }; square 7", "49");
@@ -54,6 +140,165 @@ static void test_flow() {
                    "$a]\" ; set a [+ $a 1]}",
              "0");
 
+
+  /* List-based and array-based commands */
+  tcl_register(&tcl, "args", test_cmd_args, 0, NULL);
+  tcl_register_argv(&tcl, "argc", test_cmd_argc, 0, NULL);
+  check_eval(&tcl, "args a {b c} [+ 1 2]", "args a {b c} 3");
+  check_eval(&tcl, "argc a {b c} [+ 1 2]", "4");
+  check_eval(&tcl, "argc 1 2 3 4 5 6 7 8 9 10", "11");
+
+#ifndef TCL_DISABLE_SOURCE
+  /* Scripts loaded from files, the last one without a trailing newline */
+  FILE *f = fopen("tcl_test_source.tcl", "w");
+  fputs("proc twice {x} {\n  return [* $x 2]\n}\nset y [twice 21]", f);
+  fclose(f);
+  check_eval(&tcl, "source tcl_test_source.tcl; subst $y", "42");
+  f = fopen("tcl_test_source.tcl", "w");
+  fputs("set z 1\nreturn 5\nset z 2\n", f);
+  fclose(f);
+  check_eval(&tcl, "set r [source tcl_test_source.tcl]; subst $r$z", "51");
+  remove("tcl_test_source.tcl");
+  if (tcl_eval_file(&tcl, "tcl_test_source.tcl") != FERROR) {
+    FAIL("Expected an error for a missing file\n");
+  }
+#endif
+
+  tcl_destroy(&tcl);
+
+  /* Interpreter using a pool allocator */
+  struct tcl_pool pool;
+  tcl_pool_init(&pool);
+  tcl_init_alloc(&tcl, &pool.mem);
+  check_eval(&tcl, "proc fib {x} { if {<= $x 1} {return 1} "
+                   "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; fib 15",
+             "987");
+  check_eval(&tcl, "set i 0; while {< $i 40} {set v$i \"$i$i\"; "
+                   "set i [+ $i 1]}; subst $v37",
+             "3737");
+  check_eval(&tcl, "set s {}; set i 0; while {< $i 12} "
+                   "{set s \"$s$i\"; set i [+ $i 1]}; subst $s",
+             "01234567891011");
+  tcl_destroy(&tcl);
+  tcl_pool_destroy(&pool);
+
+#ifdef TCL_ENABLE_PROFILE
+  /* Calls, time and allocations are counted per command */
+  struct tcl_profile fib = {0, 0, 0, 0, 0};
+  tcl_init(&tcl);
+  check_eval(&tcl, "proc fib {x} { if {<= $x 1} {return 1} "
+                   "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; fib 10",
+             "89");
+  tcl_profile_each(&tcl, test_profile_cmd, &fib);
+  if (fib.calls != 177 || fib.total_ns < fib.self_ns || fib.allocs == 0) {
+    FAIL("Unexpected profile of fib: %lu calls, %llu/%llu ns, %lu allocs\n",
+         fib.calls, fib.total_ns, fib.self_ns, fib.allocs);
+  }
+  if (tcl_eval(&tcl, "profile", 8) == FERROR ||
+      strstr(tcl_string(tcl.result), "fib 177 ") == NULL ||
+      strstr(tcl_string(tcl.result), "\n- 176 ") == NULL) {
+    FAIL("Unexpected profile report: %s\n", tcl_string(tcl.result));
+  }
+  const char *reset = "profile reset; fib 1; profile";
+  if (tcl_eval(&tcl, reset, strlen(reset) + 1) == FERROR ||
+      (strncmp(tcl_string(tcl.result), "fib 1 ", 6) != 0 &&
+       strncmp(tcl_string(tcl.result), "profile 1 ", 10) != 0) ||
+      strstr(tcl_string(tcl.result), "fib 177 ") != NULL) {
+    FAIL("Unexpected profile after reset: %s\n", tcl_string(tcl.result));
+  }
+  printf("OK: profile\n");
+  tcl_destroy(&tcl);
+  /* Procedures on heap frames are counted the same */
+  memset(&fib, 0, sizeof(fib));
+  tcl_init(&tcl);
+  tcl_set_stack(&tcl, 1 << 20);
+  check_eval(&tcl, "proc fib {x} { if {<= $x 1} {return 1} "
+                   "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; fib 10",
+             "89");
+  tcl_profile_each(&tcl, test_profile_cmd, &fib);
+  if (fib.calls != 177 || fib.total_ns < fib.self_ns) {
+    FAIL("Unexpected profile of fib on frames: %lu calls\n", fib.calls);
+  }
+  tcl_destroy(&tcl);
+#endif
+
+  /* Clones keep the procedures and variables, but nothing is shared */
+  struct tcl clone;
+  tcl_init(&tcl);
+  check_eval(&tcl, "proc fib {x} { if {<= $x 1} {return 1} "
+                   "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; "
+                   "proc f {x} {set a $x; set b $ a}; "
+                   "proc g {x} {return [fib [expr {$x + [- 0 0]}]]}; "
+                   "set n 10",
+             "10");
+  tcl_register_argv(&tcl, "argc", test_cmd_argc, 0, NULL);
+  if (tcl_clone(&clone, &tcl) != 0) {
+    FAIL("Failed to clone the interpreter\n");
+  }
+  check_eval(&tcl, "proc fib {x} {return 0}; set n 5; fib 3", "0");
+  tcl_destroy(&tcl);
+  check_eval(&clone, "g $n", "89");
+  check_eval(&clone, "fib 6; f 1", "");
+  check_eval(&clone, "argc a b", "3");
+  check_eval(&clone, "proc g {x} {return $x}; g $n", "10");
+  check_eval(&clone, "set m [+ $n 1]", "11");
+  if (tcl_clone_alloc(&tcl, &clone, &tcl_malloc_allocator) != 0) {
+    FAIL("Failed to clone the clone\n");
+  }
+  tcl_destroy(&clone);
+  check_eval(&tcl, "subst $m[fib 4]", "115");
+  tcl_register_argv(&tcl, "owner", test_cmd_argc, 0, malloc(1));
+  if (tcl_clone(&clone, &tcl) != -1) {
+    FAIL("Expected a command with an argument to prevent cloning\n");
+  }
+  tcl_destroy(&tcl);
+
+  /* Budget, nesting depth and hook stop runaway scripts */
+  tcl_init(&tcl);
+  tcl_set_budget(&tcl, 100);
+  check_abort(&tcl, "set i 0; while {== 1 1} {set i [+ $i 1]}",
+              TCL_ABORT_BUDGET);
+  check_abort(&tcl, "set x 1", TCL_ABORT_BUDGET);
+  tcl_set_budget(&tcl, -1);
+  check_eval(&tcl, "subst $i", "32");
+  check_abort(&tcl, "proc f {x} {f [+ $x 1]}; f 0", TCL_ABORT_DEPTH);
+  if (tcl.arena != NULL || tcl.spare == NULL) {
+    FAIL("Expected the procedure environments to be released\n");
+  }
+  check_eval(&tcl, "set x 1", "1");
+  tcl_set_depth(&tcl, 10);
+  check_eval(&tcl, "proc g {n} {if {== $n 0} {return 0} "
+                   "{return [+ 1 [g [- $n 1]]]}}; g 5",
+             "5");
+  check_abort(&tcl, "g 20", TCL_ABORT_DEPTH);
+  int calls = 0;
+  tcl_set_hook(&tcl, 10, test_hook, &calls);
+  check_abort(&tcl, "set i 0; while {== 1 1} {set i [+ $i 1]}",
+              TCL_ABORT_HOOK);
+  check_eval(&tcl, "subst $i", "15");
+  tcl_set_hook(&tcl, 1, NULL, NULL);
+  tcl_set_budget(&tcl, 1000);
+  check_abort(&tcl, "proc spin {} {while {expr {1}} {}}; spin",
+              TCL_ABORT_BUDGET);
+  tcl_destroy(&tcl);
+
+  /* Procedure frames on the heap, bounded by memory instead of depth */
+  tcl_init(&tcl);
+  tcl_set_stack(&tcl, 1 << 22);
+  check_eval(&tcl, "proc g {n} {if {== $n 0} {return 0} "
+                   "{return [+ 1 [g [- $n 1]]]}}; g 5000",
+             "5000");
+  check_eval(&tcl, "proc e {} {error oops}; proc h {} {e; return ok}; h",
+             "ok");
+  tcl_set_stack(&tcl, 4096);
+  check_eval(&tcl, "proc loop {n} {if {== $n 0} {return done} "
+                   "{return [loop [- $n 1]]}}; loop 100000",
+             "done");
+  check_abort(&tcl, "g 5000", TCL_ABORT_DEPTH);
+  if (tcl.stackused != 0) {
+    FAIL("Expected no frames left, but got %ld bytes\n", tcl.stackused);
+  }
+  check_eval(&tcl, "set x 1", "1");
   tcl_destroy(&tcl);
 }
 
@@ -46,6 +46,75 @@ static void check_tokens_len(const char *s, size_t len, int count, ...) {
   va_end(ap);
 }
 
+/* Feeds the string in chunks of every possible size, command boundaries must
+ * not depend on where the chunks are split */
+static void check_reader(const char *s, int count) {
+  size_t len = strlen(s);
+  for (size_t chunk = 1; chunk <= len; chunk++) {
+    struct tcl_reader r = {0, 0, 0, 0};
+    int n = 0;
+    for (size_t i = 0; i < len;) {
+      size_t k = (len - i < chunk ? len - i : chunk);
+      size_t end = tcl_reader_feed(&r, s + i, k);
+      i = i + (end == 0 ? k : end);
+      n = n + (end != 0);
+    }
+    if (n != count) {
+      FAIL("Expected %d commands, but found %d with chunk %d (%s)\n", count, n,
+           (int)chunk, s);
+      return;
+    }
+  }
+  printf("OK: %s -> %d commands\n", s, count);
+}
+
+/* The reader must end commands where the lexer does, the string is fed
+ * together with its terminating NUL */
+static void check_reader_lexer(const char *s) {
+  size_t len = strlen(s) + 1;
+  struct tcl_reader r = {0, 0, 0, 0};
+  size_t i = 0;
+  tcl_each(s, len, 0) {
+    if (p.token == TCMD) {
+      size_t end = tcl_reader_feed(&r, s + i, len - i);
+      if (end == 0 || s + i + end != p.to) {
+        FAIL("Reader and lexer disagree at %d (%s)\n", (int)(p.to - s), s);
+        return;
+      }
+      i = i + end;
+    }
+  }
+  /* The NUL ends the last command, unless the lexer stopped on an error */
+  if (i != len) {
+    FAIL("Lexer failed or reader found more commands (%s)\n", s);
+    return;
+  }
+  printf("OK: %s -> reader splits like the lexer\n", s);
+}
+
+/* Words and groups of every length up to a few vector widths */
+static void check_long_tokens() {
+  char s[256];
+  char word[128];
+  for (int len = 1; len < 100; len++) {
+    for (int i = 0; i < len; i++) {
+      word[i] = "aY_y\x7f\x01]"[i % 6];
+    }
+    word[len] = '\0';
+    snprintf(s, sizeof(s), "%s %s;", word, word);
+    check_tokens(s, 4, TWORD, word, TWORD, word, TCMD, ";", TCMD, "");
+    word[0] = '{';
+    word[len / 2] = '{';
+    word[len / 2 + 1] = '}';
+    word[len - 1] = '}';
+    word[len] = '\0';
+    if (len > 4) {
+      snprintf(s, sizeof(s), "%s %s;", word, word);
+      check_tokens(s, 4, TWORD, word, TWORD, word, TCMD, ";", TCMD, "");
+    }
+  }
+}
+
 static void test_lexer() {
   printf("\n");
   printf("###################\n");
@@ -150,6 +219,21 @@ static void test_lexer() {
                    "");
   check_tokens_len("set a {\nhello\n}\n", 16, 4, TWORD, "set", TWORD, "a",
                    TWORD, "{\nhello\n}", TCMD, "");
+
+  check_long_tokens();
+
+  /* Incremental command reader */
+  check_reader("set a 1\nset b 2;set c 3\n", 3);
+  check_reader("set a {\nhello;\n}\n", 1);
+  check_reader("set a [+\n1 2]\n", 1);
+  check_reader("puts \"a;\nb\"\n", 1);
+  check_reader("puts {[}; puts [{]\n", 2);
+  check_reader("proc f {} {\n  while {1} {\n    break\n  }\n}\nf", 1);
+  check_reader_lexer("set a 1\nset b {x;y}; puts \"a;b\"\n");
+  check_reader_lexer("puts \"${a;b}\"; set c [x; y]\n");
+  check_reader_lexer("set x \"${a\"b}\"; y\n");
+  check_reader_lexer("set a {\"}; b \"[c \"d\"]\"\ne");
+  check_reader_lexer("set a \"{\"; set b \"$a{\"; c");
 }
 
 #endif /* TCL_TEST_LEXER_H */
@@ -0,0 +1,173 @@
+#ifndef TCL_TEST_LIST_H
+#define TCL_TEST_LIST_H
+
+static void check_list(tcl_value_t *list, int n, const char *s) {
+  if (tcl_list_length(list) != n) {
+    FAIL("Expected %d items, but found %d (%s)\n", n, tcl_list_length(list),
+         s);
+  } else if (strcmp(tcl_string(list), s) != 0) {
+    FAIL("Expected list %s, but found %s\n", s, tcl_string(list));
+  } else {
+    printf("OK: list %s\n", s);
+  }
+}
+
+static void test_list() {
+  printf("\n");
+  printf("##################\n");
+  printf("### LIST TESTS ###\n");
+  printf("##################\n");
+  printf("\n");
+
+  tcl_value_t *list = tcl_list_alloc();
+  check_list(list, 0, "");
+  tcl_value_t *item = tcl_alloc("a", 1);
+  list = tcl_list_append(list, item);
+  tcl_free(item);
+  item = tcl_alloc("b c", 3);
+  list = tcl_list_append(list, item);
+  tcl_free(item);
+  item = tcl_alloc("", 0);
+  list = tcl_list_append(list, item);
+  tcl_free(item);
+  check_list(list, 3, "a {b c} {}");
+
+  /* Appending to a shared list leaves the other reference untouched */
+  tcl_value_t *copy = tcl_dup(list);
+  item = tcl_int_alloc(42);
+  copy = tcl_list_append(copy, item);
+  tcl_free(item);
+  check_list(list, 3, "a {b c} {}");
+  check_list(copy, 4, "a {b c} {} 42");
+  item = tcl_list_at(copy, 3);
+  if (tcl_int(item) != 42 || tcl_list_at(copy, 4) != NULL) {
+    FAIL("Wrong list items: %s\n", tcl_string(copy));
+  }
+  tcl_free(item);
+  tcl_list_free(copy);
+  tcl_list_free(list);
+
+  /* Lists parsed from strings keep the original string */
+  list = tcl_alloc("x  {y z}  {}", 12);
+  item = tcl_list_at(list, 1);
+  check_list(list, 3, "x  {y z}  {}");
+  check_list(item, 2, "y z");
+  tcl_free(item);
+  list = tcl_list_append(list, list);
+  check_list(list, 4, "x {y z} {} {x  {y z}  {}}");
+  tcl_list_free(list);
+
+  check_eval(NULL, "proc f {a b c} {subst $c$b$a}; f 1 2 3", "321");
+  check_eval(NULL, "proc f {a b c} {subst $c}; f 1 2", "");
+
+  /* List commands */
+  check_eval(NULL, "llength {a {b c} {}}", "3");
+  check_eval(NULL, "llength {}", "0");
+  check_eval(NULL, "lindex {a {b c} d} 1", "b c");
+  check_eval(NULL, "lindex {a {b c} d} end", "d");
+  check_eval(NULL, "lindex {a {b c} d} end-2", "a");
+  check_eval(NULL, "lindex {a b} 2", "");
+  check_eval(NULL, "lindex {a b} -1", "");
+  check_eval(NULL, "lindex {a b}", "a b");
+  check_eval(NULL, "lrange {a b c d e} 1 3", "b c d");
+  check_eval(NULL, "lrange {a b c d e} -5 1", "a b");
+  check_eval(NULL, "lrange {a b c d e} end-1 end", "d e");
+  check_eval(NULL, "lrange {a b c} 2 1", "");
+  check_eval(NULL, "lappend l a {b c}; lappend l {}; set l", "a {b c} {}");
+  check_eval(NULL, "set l {x y}; set m $l; lappend m z; lappend r $l $m",
+             "{x y} {x y z}");
+  check_eval(NULL, "lsort {b a {} c a}", "{} a a b c");
+  check_eval(NULL, "lsort -integer {10 9 -1 100}", "-1 9 10 100");
+  check_eval(NULL, "lsort {10 9 -1 100}", "-1 10 100 9");
+  check_eval(NULL, "lsort -decreasing -integer {3 1 2}", "3 2 1");
+  /* Stable: equal numbers keep their order */
+  check_eval(NULL, "lsort -integer {2 02 1 01 2.0}", "1 01 2 02 2.0");
+  check_eval(NULL, "lsort -integer -decreasing {1 2 02 01}", "2 02 1 01");
+  check_eval(NULL, "foreach x {a {b c} d} {lappend s $x $x}; set s",
+             "a a {b c} {b c} d d");
+  check_eval(NULL, "foreach {k v} {1 a 2 b 3} {lappend s $v $k}; set s",
+             "a 1 b 2 {} 3");
+  check_eval(NULL,
+             "set s {}; foreach x {1 2 3 4} "
+             "{if {== $x 2} {continue}; if {== $x 4} {break}; set s $s$x}; "
+             "set s",
+             "13");
+  check_eval(NULL, "set l {1 2}; foreach x $l {lappend l $x}; set l",
+             "1 2 1 2");
+  check_eval(NULL, "proc f {l} {foreach x $l {return $x}}; f {a b}", "a");
+
+  /* Large lists: built in place, sorted in n log n */
+  check_eval(NULL,
+             "set i 0; while {< $i 10000} {lappend l [- 5000 $i]; "
+             "set i [+ $i 1]}; set l [lsort -integer $l]; "
+             "lappend r [llength $l] [lindex $l 0] [lindex $l end]",
+             "10000 -4999 5000");
+
+  /* Dicts */
+  check_eval(NULL, "dict create a 1 b {x y}", "a 1 b {x y}");
+  check_eval(NULL, "dict create", "");
+  check_eval(NULL, "dict get {a 1 b 2} b", "2");
+  check_eval(NULL, "dict get {a 1 b 2 a 3}", "a 3 b 2");
+  check_eval(NULL, "dict size {a 1 b 2 a 3}", "2");
+  check_eval(NULL, "dict exists {a 1 b 2} b", "1");
+  check_eval(NULL, "dict exists {a 1 b 2} c", "0");
+  check_eval(NULL, "dict exists {a {b {c 1}}} a b c", "1");
+  check_eval(NULL, "dict exists {a {b {c 1}}} a x c", "0");
+  check_eval(NULL, "dict get {a {b {c 1}}} a b c", "1");
+  check_eval(NULL, "dict set d a 1; dict set d {b c} {}; set d",
+             "a 1 {b c} {}");
+  check_eval(NULL, "set d {a 1 b 2}; dict set d a 3", "a 3 b 2");
+  check_eval(NULL, "set d {a 1 b 2 c 3}; dict unset d b", "a 1 c 3");
+  check_eval(NULL, "set d {a 1}; dict unset d x", "a 1");
+  check_eval(NULL, "dict set d a b c 1; dict set d a b d 2; set d",
+             "a {b {c 1 d 2}}");
+  check_eval(NULL, "set d {a {b 1 c 2}}; dict unset d a b; set d", "a {c 2}");
+  check_eval(NULL, "set d {a 1}; set e $d; dict set e a 2; subst $d$e",
+             "a 1a 2");
+  check_eval(NULL,
+             "set s {}; dict for {k v} {1 a 2 b 3 c} "
+             "{if {== $k 2} {continue}; set s $s$k$v}; set s",
+             "1a3c");
+  check_eval(NULL,
+             "set d {a 1 b 2}; dict for {k v} $d {dict set d $k x}; set d",
+             "a x b x");
+  check_eval(NULL, "dict for {k v} {a 1 b 2} {break}; set k", "a");
+  /* Reading a shared list as a dict leaves its duplicate keys alone */
+  check_eval(NULL,
+             "set a {x 1 x 2}; set b $a; dict get $b x; dict size $a; "
+             "lappend r [llength $a] [dict size $b] $a",
+             "4 1 {x 1 x 2}");
+  check_eval(NULL,
+             "set s {}; dict for {k v} {a 1 b 2 a 3} {set s $s$k$v}; set s",
+             "a3b2");
+  check_eval(NULL, "set a {x 1 y 2 x 3}; set b $a; dict set b y 4; "
+                   "lappend r $a $b",
+             "{x 1 y 2 x 3} {x 3 y 4}");
+  check_eval(NULL, "dict create a 1 a 2", "a 2");
+
+  /* Many keys keep their order and stay reachable through the index */
+  check_eval(NULL,
+             "set i 0; while {< $i 100} {dict set d k$i $i; set i [+ $i 1]}; "
+             "dict unset d k50; + [dict get $d k99] [dict size $d]",
+             "198");
+
+  struct tcl tcl;
+  const char *bad[] = {"dict get {a 1} b",    "dict get {a 1 b}",
+                       "dict size {a}",       "dict create a",
+                       "dict get {a 1} a b",  "set d {a 1}; dict set d a b 2",
+                       "dict",                "dict for {k} {a 1} {}",
+                       "dict for k {a 1} {}", "dict foo",
+                       "foreach {} {a b} {}", "lsort -unique {a}",
+                       "lindex",              "llength"};
+  tcl_init(&tcl);
+  for (unsigned int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    if (tcl_eval(&tcl, bad[i], strlen(bad[i]) + 1) != FERROR) {
+      FAIL("Expected an error (%s)\n", bad[i]);
+    } else {
+      printf("OK: %s -> error\n", bad[i]);
+    }
+  }
+  tcl_destroy(&tcl);
+}
+
+#endif /* TCL_TEST_LIST_H */
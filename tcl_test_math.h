@@ -23,6 +23,49 @@ static void test_math() {
   check_eval(NULL, "/ 7 2", "3");
 
   check_eval(NULL, "set a 5;set b 7; subst [- [* 4 [+ $a $b]] 6]", "42");
+  check_eval(NULL, "- 0 2147483647", "-2147483647");
+  check_eval(NULL, "- [- 0 2147483647] 1", "-2147483648");
+  check_eval(NULL, "subst [+ 1 2][* 2 2]", "34");
+  check_eval(NULL, "set x [* 6 7]; + $x 0", "42");
+
+  /* Infix expressions */
+  check_eval(NULL, "expr {1 + 2 * 3}", "7");
+  check_eval(NULL, "expr {(1 + 2) * 3}", "9");
+  check_eval(NULL, "expr {7 / 2 + 7 % 2 - -3}", "7");
+  check_eval(NULL, "expr {1 << 4 | 3 & 6 ^ 1}", "19");
+  check_eval(NULL, "expr {!0 + ~0 + !!5}", "1");
+  check_eval(NULL, "expr {1 < 2 && 2 <= 2 && 3 > 2 && 3 >= 4 || 5 != 5}",
+             "0");
+  check_eval(NULL, "expr {0 || 7}", "1");
+  check_eval(NULL, "expr {3 > 2 ? 10 : 3 > 1 ? 20 : 30}", "10");
+  check_eval(NULL, "expr {0 ? 10 : 0 ? 20 : 30}", "30");
+  check_eval(NULL, "set a 5; set b 7; expr {$a * $b + ${a}}", "40");
+  check_eval(NULL, "set a 5; expr {[+ $a 1] * 2 + $missing}", "12");
+  check_eval(NULL, "set a 5; expr $a - 1", "4");
+  check_eval(NULL, "expr {2147483647 + 1}", "-2147483648");
+  check_eval(NULL, "set n 0; expr {0 && [set n 1]}; subst $n", "0");
+  check_eval(NULL, "set x 3; if {expr {$x > 2}} {subst big} {subst small}",
+             "big");
+  check_eval(NULL, "proc f {n} {set s 0; set i 0; "
+                   "while {expr {$i < $n}} {set s [expr {$s + $i * $i}]; "
+                   "set i [expr {$i + 1}]}; return $s}; f 10",
+             "285");
+  check_eval(NULL, "proc expr {e} {return X}; proc f {} {return [expr {1}]}; f",
+             "X");
+  check_eval(NULL, "proc f {} {return [expr {1 / 0}]}; set r ok; f", "");
+  struct tcl tcl;
+  const char *bad[] = {"expr {1 / 0}", "expr {1 +}", "expr {(1}", "expr",
+                       "expr {1 2}", "expr {$}", "expr {[+ 1 2}", "expr {}",
+                       "expr {-}",     "expr {(}"};
+  tcl_init(&tcl);
+  for (unsigned int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    if (tcl_eval(&tcl, bad[i], strlen(bad[i]) + 1) != FERROR) {
+      FAIL("Expected an error (%s)\n", bad[i]);
+    } else {
+      printf("OK: %s -> error\n", bad[i]);
+    }
+  }
+  tcl_destroy(&tcl);
 }
 
 #endif /* TCL_TEST_MATH_H */
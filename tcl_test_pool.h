@@ -0,0 +1,167 @@
+#ifndef TCL_TEST_POOL_H
+#define TCL_TEST_POOL_H
+
+#ifdef TCL_ENABLE_POOL
+#define POOL_JOBS 64
+
+static const char *pool_script =
+    "proc fib {x} { if {<= $x 1} {return 1} "
+    "{ return [+ [fib [- $x 1]] [fib [- $x 2]]]}}; "
+    "set i 0; while {< $i 100} {set i [+ $i 1]}; fib 12";
+
+/* Each thread runs its own interpreter, no state is shared between them */
+static void *pool_thread(void *arg) {
+  int *ok = arg;
+  for (int i = 0; i < 20; i++) {
+    struct tcl tcl;
+    tcl_init(&tcl);
+    if (tcl_eval(&tcl, pool_script, strlen(pool_script) + 1) == FERROR ||
+        strcmp(tcl_string(tcl.result), "233") != 0) {
+      *ok = 0;
+    }
+    tcl_destroy(&tcl);
+  }
+  return NULL;
+}
+
+/* Runs a clone while its source keeps running on the calling thread */
+static void *pool_clone_thread(void *arg) {
+  struct tcl *clone = arg;
+  for (int i = 0; i < 20; i++) {
+    if (tcl_eval(clone, "fib 12", 7) == FERROR ||
+        strcmp(tcl_string(clone->result), "233") != 0) {
+      return NULL;
+    }
+  }
+  return clone;
+}
+
+struct pool_result {
+  int flow;
+  char s[16];
+};
+
+static void pool_done(struct tcl *tcl, int flow, void *arg) {
+  struct pool_result *r = arg;
+  r->flow = flow;
+  snprintf(r->s, sizeof(r->s), "%s", tcl_string(tcl->result));
+}
+
+static int pool_square(struct tcl *tcl, int argc, tcl_value_t **argv,
+                       void *arg) {
+  (void)argc;
+  (void)arg;
+  int n = tcl_int(argv[1]);
+  return tcl_result(tcl, FNORMAL, tcl_int_alloc(n * n));
+}
+
+static void pool_init(struct tcl *tcl, void *arg) {
+  tcl_register_argv(tcl, arg, pool_square, 2, NULL);
+}
+#endif
+
+static void test_pool() {
+  printf("\n");
+  printf("##################\n");
+  printf("### POOL TESTS ###\n");
+  printf("##################\n");
+  printf("\n");
+
+#ifdef TCL_ENABLE_POOL
+  pthread_t threads[4];
+  int ok[4];
+  for (int i = 0; i < 4; i++) {
+    ok[i] = 1;
+    pthread_create(&threads[i], NULL, pool_thread, &ok[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    if (!ok[i]) {
+      FAIL("Thread %d got a wrong result\n", i);
+    }
+  }
+  printf("OK: concurrent interpreters\n");
+
+  /* A clone doesn't share the pool allocator of its source */
+  struct tcl_pool mem;
+  struct tcl src, clone;
+  void *done = NULL;
+  tcl_pool_init(&mem);
+  tcl_init_alloc(&src, &mem.mem);
+  tcl_eval(&src, pool_script, strlen(pool_script) + 1);
+  if (tcl_clone(&clone, &src) != 0) {
+    FAIL("Failed to clone the interpreter\n");
+  }
+  pthread_create(&threads[0], NULL, pool_clone_thread, &clone);
+  for (int i = 0; i < 20; i++) {
+    tcl_eval(&src, pool_script, strlen(pool_script) + 1);
+  }
+  pthread_join(threads[0], &done);
+  if (done != &clone || strcmp(tcl_string(src.result), "233") != 0) {
+    FAIL("Clone of a pool interpreter failed on another thread\n");
+  }
+  tcl_destroy(&clone);
+  tcl_destroy(&src);
+  tcl_pool_destroy(&mem);
+  printf("OK: clone on another thread\n");
+
+  /* Jobs are spread over the workers and may be stolen by idle ones */
+  static char scripts[POOL_JOBS][32];
+  struct pool_result results[POOL_JOBS];
+  struct tcl_workers pool;
+  if (tcl_workers_init(&pool, 3, pool_init, "square") != 0) {
+    FAIL("Failed to start the workers\n");
+  }
+  for (int i = 0; i < POOL_JOBS; i++) {
+    if (i == 5) {
+      snprintf(scripts[i], sizeof(scripts[i]), "nosuchcommand");
+    } else {
+      snprintf(scripts[i], sizeof(scripts[i]), "set x %d; square $x", i);
+    }
+    tcl_workers_submit(&pool, scripts[i], strlen(scripts[i]) + 1, pool_done,
+                       &results[i]);
+  }
+  tcl_workers_wait(&pool);
+  for (int i = 0; i < POOL_JOBS; i++) {
+    char expected[16];
+    snprintf(expected, sizeof(expected), "%d", i * i);
+    if (i == 5) {
+      if (results[i].flow != FERROR) {
+        FAIL("Expected an error from job %d\n", i);
+      }
+    } else if (results[i].flow == FERROR ||
+               strcmp(results[i].s, expected) != 0) {
+      FAIL("Expected %s from job %d, but got %s\n", expected, i,
+           results[i].s);
+    }
+  }
+  printf("OK: %d jobs on 3 workers\n", POOL_JOBS);
+
+  /* Jobs left in the queues are finished before the workers stop */
+  for (int i = 0; i < POOL_JOBS; i++) {
+    results[i].s[0] = '\0';
+    tcl_workers_submit(&pool, pool_script, strlen(pool_script) + 1, pool_done,
+                       &results[i]);
+  }
+  tcl_workers_destroy(&pool);
+  for (int i = 0; i < POOL_JOBS; i++) {
+    if (strcmp(results[i].s, "233") != 0) {
+      FAIL("Job %d was not finished\n", i);
+    }
+  }
+  printf("OK: destroy finishes the queued jobs\n");
+
+  /* A pool without workers rejects jobs instead of dividing by zero */
+  if (tcl_workers_init(&pool, 0, NULL, NULL) != -1 ||
+      tcl_workers_submit(&pool, "set x", 6, NULL, NULL) != -1) {
+    FAIL("Expected a pool without workers to fail\n");
+  }
+  tcl_workers_wait(&pool);
+  tcl_workers_destroy(&pool);
+  printf("OK: pool without workers\n");
+#else
+  printf("Skipped, build with -DTCL_ENABLE_POOL -pthread\n");
+#endif
+}
+
+#endif /* TCL_TEST_POOL_H */
@@ -29,6 +29,18 @@ static void test_subst() {
   printf("###################\n");
   printf("\n");
 
+  /* Values are shared, copied on write and may contain NUL characters */
+  tcl_value_t *v = tcl_alloc("a\0b", 3);
+  tcl_value_t *w = tcl_append(tcl_dup(v), tcl_alloc("c", 1));
+  if (tcl_length(v) != 3 || memcmp(tcl_string(v), "a\0b", 4) != 0 ||
+      tcl_length(w) != 4 || memcmp(tcl_string(w), "a\0bc", 5) != 0) {
+    FAIL("Copy-on-write append modified the shared value\n");
+  } else {
+    printf("OK: copy-on-write append\n");
+  }
+  tcl_free(v);
+  tcl_free(w);
+
   check_eval(NULL, "subst hello", "hello");
   check_eval(NULL, "subst {hello}", "hello");
   check_eval(NULL, "subst {hello world}", "hello world");
@@ -49,6 +61,20 @@ static void test_subst() {
   check_eval(&tcl, "subst $$$foo", "Hello");
   tcl_destroy(&tcl);
 
+  /* Names are interned once, atoms of dynamic names go away with their
+   * variables, and a variable may share the atom of a command */
+  tcl_init(&tcl);
+  check_eval(&tcl,
+             "proc f {n} {set i 0; while {< $i $n} {set v$i $i; "
+             "set i [+ $i 1]}; subst $v3}; f 10",
+             "3");
+  int atoms = tcl.atoms.count;
+  check_eval(&tcl, "f 1000; set set 1; set set", "1");
+  if (tcl.atoms.count != atoms) {
+    FAIL("Expected %d atoms, but found %d\n", atoms, tcl.atoms.count);
+  }
+  tcl_destroy(&tcl);
+
   check_eval(NULL, "subst {hello}{world}", "helloworld");
   check_eval(NULL, "subst hello[subst world]", "helloworld");
   check_eval(NULL, "subst hello[\n]world", "helloworld");
@@ -65,6 +91,13 @@ static void test_subst() {
   check_eval(NULL, "set {a \"b\"} hello; subst ${a \"b\"}", "hello");
   check_eval(NULL, "set \"a b\" hello; subst ${a b}", "hello");
 
+  /* Variable names have no length limit */
+  char name[301] = {0};
+  char script[700];
+  memset(name, 'v', 300);
+  snprintf(script, sizeof(script), "set %s hello; subst $%s", name, name);
+  check_eval(NULL, script, "hello");
+
   check_eval(NULL, "set q {\"}; set msg hello; subst $q$msg$q", "\"hello\"");
   check_eval(NULL, "set q {\"}; subst $q[]hello[]$q", "\"hello\"");
   check_eval(NULL, "set x {\n\thello\n}", "\n\thello\n");